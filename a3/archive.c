@@ -0,0 +1,806 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "archive.h"
+#include "copy.h"
+#include "ftree.h"
+#include "plan.h"
+
+// Sizes of the fixed parts of the format.
+#define HEADER_SIZE 24          // Magic, version, count, record bytes.
+#define RECORD_SIZE 32          // A record without its path.
+#define INDEX_ENTRY_SIZE 24     // Record number, offset, size.
+#define FOOTER_SIZE 24          // Magic, index offset, entry count.
+
+// Record types.
+#define TYPE_DIR 'd'
+#define TYPE_FILE 'f'
+
+// Record flags.
+#define FLAG_SPARSE 1           // The data is a map of extents, then them.
+
+// Bytes of the extent count, and of each extent, in a map.
+#define MAP_COUNT_SIZE 8
+#define MAP_EXTENT_SIZE 16
+
+// Most extents a map may hold, to bound what a bad archive can allocate.
+#define MAP_EXTENTS_MAX (1 << 24)
+
+// Round n up to the next ARCHIVE_ALIGN boundary.
+#define ALIGN_UP(n) (((n) + ARCHIVE_ALIGN - 1) / ARCHIVE_ALIGN * ARCHIVE_ALIGN)
+
+// One record, as read back from an archive.
+struct record {
+    int type;
+    int flags;
+    int failed;             // Set if it could not be unpacked.
+    mode_t mode;
+    off_t size;
+    struct timespec mtime;
+    char *path;
+};
+
+// A run of data in a sparse file.
+struct extent {
+    off_t offset;
+    off_t len;
+};
+
+// A block of zeros for padding.
+static const char zeros[ARCHIVE_ALIGN];
+
+
+/* Store the low bytes bytes of value at p, least significant first.
+ */
+static void put_le(unsigned char *p, unsigned long long value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        p[i] = value >> (8 * i);
+    }
+}
+
+
+/* Return the bytes byte little-endian number at p.
+ */
+static unsigned long long get_le(const unsigned char *p, int bytes) {
+    unsigned long long value = 0;
+
+    for (int i = bytes - 1; i >= 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+
+/* Write all count bytes of buf to fd. Return 0 on success, or -1 on error.
+ */
+static int write_full(int fd, const void *buf, size_t count) {
+    const char *p = buf;
+
+    while (count > 0) {
+        ssize_t n = write(fd, p, count);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            return -1;
+        }
+        p += n;
+        count -= n;
+    }
+    return 0;
+}
+
+
+/* Read count bytes from fd into buf, which may be NULL to throw them away.
+ * Return 0 on success, or -1 on error or if the stream ends first.
+ */
+static int read_full(int fd, void *buf, size_t count) {
+    char scratch[ARCHIVE_ALIGN];
+    char *p = buf;
+
+    while (count > 0) {
+        size_t len = count;
+        if (buf == NULL && len > sizeof(scratch)) {
+            len = sizeof(scratch);
+        }
+        ssize_t n = read(fd, buf ? p : scratch, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            return -1;
+        }
+        if (n == 0) {
+            fprintf(stderr, "Archive ends unexpectedly\n");
+            return -1;
+        }
+        if (buf != NULL) {
+            p += n;
+        }
+        count -= n;
+    }
+    return 0;
+}
+
+
+/* Write zeros to fd until offset, now at pos, reaches the next ARCHIVE_ALIGN
+ * boundary. Return 0 on success, or -1 on error.
+ */
+static int pad(int fd, off_t pos) {
+    return write_full(fd, zeros, ALIGN_UP(pos) - pos);
+}
+
+
+/* Write len zeros to fd. Return 0 on success, or -1 on error.
+ */
+static int write_zeros(int fd, off_t len) {
+    while (len > 0) {
+        size_t n = len > ARCHIVE_ALIGN ? ARCHIVE_ALIGN : len;
+        if (write_full(fd, zeros, n) == -1) {
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+
+/* Return 1 if entry is a file with holes, which is packed as its extents.
+ */
+static int is_sparse(const struct plan_entry *entry) {
+    return S_ISREG(entry->st.st_mode) &&
+           entry->st.st_blocks * 512 < entry->st.st_size;
+}
+
+
+/* Append the record for entry to the header being built at *buf, which holds
+ * *len bytes of *cap. Return 0 on success, or -1 on error.
+ */
+static int add_record(unsigned char **buf, size_t *len, size_t *cap,
+                      const struct plan_entry *entry, int type) {
+    size_t path_len = strlen(entry->dest);
+
+    while (*len + RECORD_SIZE + path_len > *cap) {
+        *cap *= 2;
+        *buf = realloc(*buf, *cap);
+        if (*buf == NULL) {
+            perror("realloc");
+            return -1;
+        }
+    }
+
+    unsigned char *p = *buf + *len;
+    memset(p, 0, RECORD_SIZE);
+    p[0] = type;
+    p[1] = type == TYPE_FILE && is_sparse(entry) ? FLAG_SPARSE : 0;
+    put_le(p + 4, entry->st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO), 4);
+    put_le(p + 8, type == TYPE_FILE ? entry->st.st_size : 0, 8);
+    put_le(p + 16, entry->st.st_mtim.tv_sec, 8);
+    put_le(p + 24, entry->st.st_mtim.tv_nsec, 4);
+    put_le(p + 28, path_len, 4);
+    memcpy(p + RECORD_SIZE, entry->dest, path_len);
+    *len += RECORD_SIZE + path_len;
+    return 0;
+}
+
+
+/* Find the data extents in the first size bytes of src_fd with SEEK_DATA
+ * and SEEK_HOLE, and save them in a new array at *extents.
+ * Return how many there are, or -1 on error.
+ */
+static int find_extents(int src_fd, off_t size, struct extent **extents) {
+    int count = 0, cap = 0;
+    off_t pos = 0;
+
+    *extents = NULL;
+    while (pos < size) {
+        off_t start = lseek(src_fd, pos, SEEK_DATA);
+        off_t end;
+
+        // ENXIO means there is only a hole left.
+        if (start == -1 && errno == ENXIO) {
+            break;
+        }
+        if (start == -1 || (end = lseek(src_fd, start, SEEK_HOLE)) == -1) {
+            perror("lseek");
+            free(*extents);
+            *extents = NULL;
+            return -1;
+        }
+        if (start >= size) {
+            break;
+        }
+
+        if (count == cap) {
+            cap = cap ? cap * 2 : 16;
+            *extents = realloc(*extents, cap * sizeof(struct extent));
+            if (*extents == NULL) {
+                perror("realloc");
+                exit(-1);
+            }
+        }
+        (*extents)[count].offset = start;
+        (*extents)[count].len = (end < size ? end : size) - start;
+        count++;
+        pos = end;
+    }
+    return count;
+}
+
+
+/* Write the map of the count extents to fd, padded to ARCHIVE_ALIGN, and
+ * return the bytes it took, or -1 on error.
+ */
+static off_t write_map(int fd, const struct extent *extents, int count) {
+    size_t len = MAP_COUNT_SIZE + (size_t)count * MAP_EXTENT_SIZE;
+    unsigned char *map = calloc(ALIGN_UP(len), 1);
+
+    if (map == NULL) {
+        perror("calloc");
+        exit(-1);
+    }
+    put_le(map, count, MAP_COUNT_SIZE);
+    for (int i = 0; i < count; i++) {
+        unsigned char *p = map + MAP_COUNT_SIZE + (size_t)i * MAP_EXTENT_SIZE;
+        put_le(p, extents[i].offset, 8);
+        put_le(p + 8, extents[i].len, 8);
+    }
+
+    int result = write_full(fd, map, ALIGN_UP(len));
+    free(map);
+    return result == -1 ? -1 : (off_t)ALIGN_UP(len);
+}
+
+
+/* Write the contents of entry's source to fd, padded to ARCHIVE_ALIGN, and
+ * save the bytes they took in *stored. A sparse file is written as the map
+ * of its extents and the data in them. A source that has shrunk is padded
+ * out to its planned size with zeros, so the archive stays readable.
+ * Return 0 on success, or -1 on error.
+ */
+static int pack_file(int fd, const struct plan_entry *entry, off_t *stored) {
+    off_t size = entry->st.st_size, want = size, done = 0;
+    struct extent whole = {0, size};
+    struct extent *extents = &whole, *found = NULL;
+    int count = 1, ok = 1;
+    int src_fd = open(entry->src, O_RDONLY);
+
+    if (src_fd == -1) {
+        perror("open");
+        ok = 0;
+    } else {
+        posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    // The record already says whether the file is sparse. If its extents
+    // can't be found, it is stored as all holes.
+    *stored = 0;
+    if (is_sparse(entry)) {
+        count = src_fd == -1 ? -1 : find_extents(src_fd, size, &found);
+        if (count == -1) {
+            count = 0;
+            ok = 0;
+        }
+        extents = found;
+        want = 0;
+        for (int i = 0; i < count; i++) {
+            want += extents[i].len;
+        }
+        if ((*stored = write_map(fd, extents, count)) == -1) {
+            free(found);
+            if (src_fd != -1) {
+                close(src_fd);
+            }
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < count && ok; i++) {
+        off_t n = -1;
+        if (lseek(src_fd, extents[i].offset, SEEK_SET) != -1) {
+            n = stream_data(src_fd, fd, extents[i].len);
+        } else {
+            perror("lseek");
+        }
+        if (n == -1) {
+            free(found);
+            close(src_fd);
+            return -1;
+        }
+        done += n;
+        if (n < extents[i].len) {
+            ok = 0;
+        }
+    }
+    free(found);
+    if (src_fd != -1) {
+        close(src_fd);
+    }
+
+    if (write_zeros(fd, want - done) == -1 || pad(fd, want) == -1) {
+        return -1;
+    }
+    *stored += ALIGN_UP(want);
+
+    if (!ok) {
+        fprintf(stderr, "Error packing %s\n", entry->src);
+        copy_summary.errors++;
+    } else {
+        copy_summary.files_copied++;
+    }
+    return 0;
+}
+
+
+int archive_pack(const char *src, const char *path) {
+    struct plan plan;
+    char *src_copy = strdup(src);
+    size_t len = HEADER_SIZE, cap = 64 * 1024;
+    unsigned char *header = malloc(cap);
+    unsigned char *index;
+    int fd = STDOUT_FILENO;
+
+    if (src_copy == NULL || header == NULL) {
+        perror("malloc");
+        exit(-1);
+    }
+
+    // Paths in the archive start at the basename of src, as in a copy.
+    memset(&plan, 0, sizeof(plan));
+    plan_build_new(&plan, src, basename(src_copy));
+    plan_sort(&plan);
+    copy_summary.errors = plan.errors;
+
+    for (int i = 0; i < plan.num_dirs; i++) {
+        if (add_record(&header, &len, &cap, &plan.dirs[i], TYPE_DIR) == -1) {
+            exit(-1);
+        }
+    }
+    for (int i = 0; i < plan.num_files; i++) {
+        if (add_record(&header, &len, &cap, &plan.files[i], TYPE_FILE) == -1) {
+            exit(-1);
+        }
+    }
+    memcpy(header, ARCHIVE_MAGIC, 8);
+    put_le(header + 8, ARCHIVE_VERSION, 4);
+    put_le(header + 12, plan.num_dirs + plan.num_files, 4);
+    put_le(header + 16, len - HEADER_SIZE, 8);
+
+    index = malloc((size_t)plan.num_files * INDEX_ENTRY_SIZE + FOOTER_SIZE);
+    if (index == NULL) {
+        perror("malloc");
+        exit(-1);
+    }
+
+    if (strcmp(path, "-") != 0 &&
+        (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        perror("open");
+        exit(-1);
+    }
+
+    int result = write_full(fd, header, len) == 0 && pad(fd, len) == 0 ? 0 : -1;
+    off_t offset = ALIGN_UP(len);
+
+    // The files go in the order that reads the source most sequentially.
+    for (int i = 0; i < plan.num_files && result == 0; i++) {
+        unsigned char *p = index + (size_t)i * INDEX_ENTRY_SIZE;
+        put_le(p, plan.num_dirs + i, 8);
+        put_le(p + 8, offset, 8);
+        put_le(p + 16, plan.files[i].st.st_size, 8);
+
+        off_t stored;
+        result = pack_file(fd, &plan.files[i], &stored);
+        offset += stored;
+    }
+    copy_summary.dirs = plan.num_dirs;
+
+    if (result == 0) {
+        unsigned char *footer = index + (size_t)plan.num_files * INDEX_ENTRY_SIZE;
+        memcpy(footer, ARCHIVE_INDEX_MAGIC, 8);
+        put_le(footer + 8, offset, 8);
+        put_le(footer + 16, plan.num_files, 8);
+        result = write_full(fd, index, footer + FOOTER_SIZE - index);
+    }
+
+    if (fd != STDOUT_FILENO && close(fd) == -1) {
+        perror("close");
+        result = -1;
+    }
+    if (result == -1) {
+        copy_summary.errors++;
+    }
+
+    free(index);
+    free(header);
+    free(src_copy);
+    plan_free(&plan);
+    return copy_summary.errors > 0 ? -1 : 0;
+}
+
+
+/* Return 1 if path is safe to create under the unpack directory: relative,
+ * and without any ".." component. Return 0 otherwise.
+ */
+static int safe_path(const char *path) {
+    const char *p = path;
+
+    if (*path == '\0' || *path == '/') {
+        return 0;
+    }
+    while (p != NULL) {
+        if (strncmp(p, "..", 2) == 0 && (p[2] == '/' || p[2] == '\0')) {
+            return 0;
+        }
+        p = strchr(p, '/');
+        if (p != NULL) {
+            p++;
+        }
+    }
+    return 1;
+}
+
+
+/* Parse the len bytes of records at buf into records, which holds count.
+ * Return 0 on success, or -1 if they are malformed.
+ */
+static int parse_records(const unsigned char *buf, size_t len,
+                         struct record *records, int count) {
+    size_t pos = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (pos + RECORD_SIZE > len) {
+            return -1;
+        }
+        const unsigned char *p = buf + pos;
+        size_t path_len = get_le(p + 28, 4);
+        if (pos + RECORD_SIZE + path_len > len || path_len >= PATH_MAX) {
+            return -1;
+        }
+
+        records[i].type = p[0];
+        records[i].flags = p[1];
+        records[i].mode = get_le(p + 4, 4) & (S_IRWXU | S_IRWXG | S_IRWXO);
+        records[i].size = get_le(p + 8, 8);
+        records[i].mtime.tv_sec = get_le(p + 16, 8);
+        records[i].mtime.tv_nsec = get_le(p + 24, 4);
+        records[i].path = strndup((const char *)p + RECORD_SIZE, path_len);
+        if (records[i].path == NULL) {
+            perror("strndup");
+            exit(-1);
+        }
+        if ((records[i].type != TYPE_DIR && records[i].type != TYPE_FILE) ||
+            (records[i].flags & ~FLAG_SPARSE) != 0 || records[i].size < 0 || !safe_path(records[i].path)) {
+            fprintf(stderr, "Bad archive entry: %s\n", records[i].path);
+            return -1;
+        }
+        pos += RECORD_SIZE + path_len;
+    }
+    return 0;
+}
+
+
+/* Create the directory for rec at path, or update the mode of one that is
+ * already there. Return 0 on success, or -1 on error.
+ */
+static int unpack_dir(const struct record *rec, const char *path) {
+    struct stat st;
+
+    if (mkdir(path, rec->mode) == 0) {
+        return 0;
+    }
+    if (errno != EEXIST) {
+        perror("mkdir");
+        return -1;
+    }
+    if (lstat(path, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Error Mismatch between archive and destination:\n%s\n",
+                path);
+        return -1;
+    }
+    if (chmod(path, rec->mode) == -1) {
+        perror("chmod");
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Read the map of a sparse file's extents from fd into a new array at
+ * *extents, and check they are in order and within size bytes.
+ * Return how many there are, or -1 if the archive can't be read on.
+ */
+static int read_map(int fd, off_t size, struct extent **extents) {
+    unsigned char head[MAP_COUNT_SIZE];
+
+    *extents = NULL;
+    if (read_full(fd, head, MAP_COUNT_SIZE) == -1) {
+        return -1;
+    }
+    unsigned long long count = get_le(head, MAP_COUNT_SIZE);
+    if (count > MAP_EXTENTS_MAX) {
+        fprintf(stderr, "Bad extent map in archive\n");
+        return -1;
+    }
+
+    size_t len = count * MAP_EXTENT_SIZE;
+    unsigned char *map = malloc(len ? len : 1);
+    *extents = malloc((count ? count : 1) * sizeof(struct extent));
+    if (map == NULL || *extents == NULL) {
+        perror("malloc");
+        exit(-1);
+    }
+    if (read_full(fd, map, len) == -1 ||
+        read_full(fd, NULL, ALIGN_UP(MAP_COUNT_SIZE + len) -
+                            MAP_COUNT_SIZE - len) == -1) {
+        free(map);
+        return -1;
+    }
+
+    off_t end = 0;
+    for (size_t i = 0; i < count; i++) {
+        off_t offset = get_le(map + i * MAP_EXTENT_SIZE, 8);
+        off_t ext_len = get_le(map + i * MAP_EXTENT_SIZE + 8, 8);
+        if (offset < end || ext_len < 0 || ext_len > size - offset) {
+            fprintf(stderr, "Bad extent map in archive\n");
+            free(map);
+            return -1;
+        }
+        (*extents)[i].offset = offset;
+        (*extents)[i].len = ext_len;
+        end = offset + ext_len;
+    }
+    free(map);
+    return count;
+}
+
+
+/* Copy the data of rec, and the padding after it, from fd into dest_fd, or
+ * only read past it if dest_fd is -1. The extents of a sparse file are
+ * written at their offsets, so the gaps between them stay holes.
+ * Return 0 on success, or -1 if the archive can't be read on.
+ */
+static int unpack_data(int fd, const struct record *rec, int dest_fd) {
+    struct extent whole = {0, rec->size};
+    struct extent *extents = &whole, *found = NULL;
+    int count = 1;
+    off_t want = rec->size, done = 0;
+
+    if (rec->flags & FLAG_SPARSE) {
+        if ((count = read_map(fd, rec->size, &found)) == -1) {
+            free(found);
+            return -1;
+        }
+        extents = found;
+        want = 0;
+        for (int i = 0; i < count; i++) {
+            want += extents[i].len;
+        }
+    }
+
+    for (int i = 0; i < count && dest_fd != -1; i++) {
+        off_t n = -1;
+        if (lseek(dest_fd, extents[i].offset, SEEK_SET) == -1) {
+            perror("lseek");
+        } else {
+            n = stream_data(fd, dest_fd, extents[i].len);
+        }
+        if (n != extents[i].len) {
+            if (n != -1) {
+                fprintf(stderr, "Archive ends unexpectedly\n");
+            }
+            free(found);
+            return -1;
+        }
+        done += n;
+    }
+    free(found);
+
+    // Without a destination the data is only skipped.
+    return read_full(fd, NULL, ALIGN_UP(want) - done) == -1 ? -1 : 0;
+}
+
+
+/* Write the data of rec from fd, and read the padding after it, to a new
+ * file at path. Return 0 on success, 1 if the file could not be written but
+ * the archive can still be read, or -1 if the archive can't be read on.
+ */
+static int unpack_file(int fd, const struct record *rec, const char *path) {
+    struct timespec times[2] = {rec->mtime, rec->mtime};
+    // A link at path must not take the file somewhere else.
+    int dest_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW,
+                       rec->mode);
+    int result = 0;
+
+    // The data still has to be read past to get to the next file.
+    if (dest_fd == -1) {
+        perror("open");
+        return unpack_data(fd, rec, -1) == -1 ? -1 : 1;
+    }
+
+    if (unpack_data(fd, rec, dest_fd) == -1) {
+        result = -1;
+
+    // A sparse file may end in a hole, which no extent reaches.
+    } else if (ftruncate(dest_fd, rec->size) == -1) {
+        perror("ftruncate");
+        result = 1;
+    } else if (futimens(dest_fd, times) == -1) {
+        perror("futimens");
+        result = 1;
+    }
+
+    if (close(dest_fd) == -1) {
+        perror("close");
+        return result == -1 ? -1 : 1;
+    }
+    return result;
+}
+
+
+/* Return 1 if the path of record i is inside a directory of records that
+ * could not be unpacked, whose indexes are the num in failed, or 0 if not.
+ */
+static int under_failed(const struct record *records, int i,
+                        const int *failed, int num) {
+    for (int j = 0; j < num; j++) {
+        const char *dir = records[failed[j]].path;
+        size_t len = strlen(dir);
+        if (strncmp(records[i].path, dir, len) == 0 &&
+            records[i].path[len] == '/') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/* Set the times of the directories in records, deepest first, now that
+ * unpacking their contents has stopped changing them.
+ */
+static void set_dir_times(struct record *records, int count,
+                          const char *dest) {
+    char new_path[PATH_MAX];
+
+    // Parents come before their children, so going backwards reaches every
+    // directory after everything in it.
+    for (int i = count - 1; i >= 0; i--) {
+        struct timespec times[2] = {records[i].mtime, records[i].mtime};
+        if (records[i].type != TYPE_DIR || records[i].failed) {
+            continue;
+        }
+        snprintf(new_path, PATH_MAX, "%s/%s", dest, records[i].path);
+        if (utimensat(AT_FDCWD, new_path, times, AT_SYMLINK_NOFOLLOW) == -1) {
+            perror("utimensat");
+            copy_summary.errors++;
+        }
+    }
+}
+
+
+int archive_unpack(const char *path, const char *dest) {
+    unsigned char header[HEADER_SIZE], footer[FOOTER_SIZE];
+    char new_path[PATH_MAX];
+    struct stat st;
+    int fd = STDIN_FILENO;
+    int result = 0;
+
+    if (stat(dest, &st) == -1) {
+        perror("stat");
+        fprintf(stderr, "Destination directory %s not found\n", dest);
+        exit(-1);
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Destination %s is not a directory\n", dest);
+        exit(-1);
+    }
+
+    if (strcmp(path, "-") != 0 && (fd = open(path, O_RDONLY)) == -1) {
+        perror("open");
+        exit(-1);
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (read_full(fd, header, HEADER_SIZE) == -1 ||
+        memcmp(header, ARCHIVE_MAGIC, 8) != 0 ||
+        get_le(header + 8, 4) < 1 || get_le(header + 8, 4) > ARCHIVE_VERSION) {
+        fprintf(stderr, "%s is not an archive this version can read\n", path);
+        exit(-1);
+    }
+
+    int count = get_le(header + 12, 4);
+    size_t len = get_le(header + 16, 8);
+    unsigned char *buf = malloc(len ? len : 1);
+    struct record *records = calloc(count ? count : 1, sizeof(struct record));
+    int *failed = malloc((count ? count : 1) * sizeof(int));
+    int num_failed = 0;
+    if (buf == NULL || records == NULL || failed == NULL) {
+        perror("malloc");
+        exit(-1);
+    }
+    if (read_full(fd, buf, len) == -1 ||
+        read_full(fd, NULL, ALIGN_UP(HEADER_SIZE + len) - HEADER_SIZE - len) == -1 ||
+        parse_records(buf, len, records, count) == -1) {
+        fprintf(stderr, "Bad archive header in %s\n", path);
+        exit(-1);
+    }
+
+    // Records are in data order, with every directory before its contents,
+    // so the archive is unpacked in one pass.
+    for (int i = 0; i < count && result != -1; i++) {
+        int skip = 0;
+
+        // Nothing goes into a directory that could not be made, since
+        // whatever is at its path may lead outside dest.
+        if (under_failed(records, i, failed, num_failed)) {
+            fprintf(stderr, "Skipping %s/%s\n", dest, records[i].path);
+            skip = 1;
+        } else if (snprintf(new_path, PATH_MAX, "%s/%s", dest,
+                            records[i].path) >= PATH_MAX) {
+            fprintf(stderr, "Path too long: %s/%s\n", dest, records[i].path);
+            skip = 1;
+        }
+        if (skip) {
+            copy_summary.errors++;
+            records[i].failed = 1;
+            if (records[i].type == TYPE_DIR) {
+                failed[num_failed++] = i;
+            } else if (unpack_data(fd, &records[i], -1) == -1) {
+                result = -1;
+            }
+            continue;
+        }
+
+        if (records[i].type == TYPE_DIR) {
+            if (unpack_dir(&records[i], new_path) == -1) {
+                copy_summary.errors++;
+                records[i].failed = 1;
+                failed[num_failed++] = i;
+            } else {
+                copy_summary.dirs++;
+            }
+        } else {
+            result = unpack_file(fd, &records[i], new_path);
+            if (result == 0) {
+                copy_summary.files_copied++;
+            } else {
+                copy_summary.errors++;
+            }
+        }
+    }
+
+    // The index is only needed for random access, but reading it checks the
+    // archive was written out completely.
+    if (result != -1) {
+        int files = 0;
+        for (int i = 0; i < count; i++) {
+            files += records[i].type == TYPE_FILE;
+        }
+        if (read_full(fd, NULL, (size_t)files * INDEX_ENTRY_SIZE) == -1 ||
+            read_full(fd, footer, FOOTER_SIZE) == -1 ||
+            memcmp(footer, ARCHIVE_INDEX_MAGIC, 8) != 0) {
+            fprintf(stderr, "Archive %s has no valid index\n", path);
+            copy_summary.errors++;
+        }
+    }
+    set_dir_times(records, count, dest);
+
+    for (int i = 0; i < count; i++) {
+        free(records[i].path);
+    }
+    free(records);
+    free(failed);
+    free(buf);
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+    return copy_summary.errors > 0 ? -1 : 0;
+}
@@ -0,0 +1,35 @@
+#ifndef _ARCHIVE_H_
+#define _ARCHIVE_H_
+
+// An archive holds a tree in one stream, laid out as:
+//   header    ARCHIVE_MAGIC, version, record count, record bytes, then one
+//             record per directory and file: type, flags, mode, size, mtime
+//             and path. Directories come first, parents before children.
+//   data      The contents of each file, in record order, each starting on
+//             an ARCHIVE_ALIGN boundary and padded with zeros. A file with
+//             the sparse flag holds only its data extents: first their
+//             count and each one's offset and length, padded, then the bytes
+//             in them, one after another, padded. The rest is holes.
+//   index     For each file, its record number, data offset and size, then
+//             ARCHIVE_INDEX_MAGIC, the offset of the index and its length.
+// Every number is little-endian. The header lets the archive be unpacked
+// from a pipe in one pass; the index lets a reader that can seek find any
+// file from the end.
+#define ARCHIVE_MAGIC "FTREEAR1"
+#define ARCHIVE_INDEX_MAGIC "FTREEIX1"
+#define ARCHIVE_VERSION 2
+#define ARCHIVE_ALIGN 4096
+
+/* Write the tree rooted at src to the archive file at path, or to stdout if
+ * path is "-". copy_summary counts what was packed.
+ * Return 0 on success, or -1 if anything could not be packed.
+ */
+int archive_pack(const char *src, const char *path);
+
+/* Recreate the tree in the archive file at path, or on stdin if path is "-",
+ * inside the directory dest. copy_summary counts what was unpacked.
+ * Return 0 on success, or -1 on error.
+ */
+int archive_unpack(const char *path, const char *dest);
+
+#endif // _ARCHIVE_H_
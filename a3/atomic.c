@@ -0,0 +1,206 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "atomic.h"
+#include "journal.h"
+
+// Starting size of the queue of files waiting to be renamed.
+#define QUEUE_INITIAL 64
+
+// A finished temporary file waiting to replace its destination.
+struct pending {
+    char *tmp;
+    char *dest;
+    const struct stat *src_st;  // Of the source, for the journal.
+    int *failed;                // Set if the rename fails.
+};
+
+// Everything below is protected by lock.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pending *queue;
+static int num_pending;
+static int max_pending;
+static long long pending_bytes;
+static int failed;          // Files that could not be renamed.
+
+// An open file on the destination filesystem, for syncfs. Files on any other
+// filesystem are synced one by one as they are queued.
+static int sync_fd = -1;
+static dev_t sync_dev;
+
+
+int atomic_open(const char *dest, mode_t mode, char *tmp) {
+    const char *slash = strrchr(dest, '/');
+    int dir_len = slash ? slash - dest + 1 : 0;
+    int fd;
+
+    // A leading dot keeps the file out of the next copy's plan.
+    if (snprintf(tmp, PATH_MAX, "%.*s.%s.fcopy-XXXXXX", dir_len, dest,
+                 dest + dir_len) >= PATH_MAX) {
+        fprintf(stderr, "Path too long: %s\n", dest);
+        return -1;
+    }
+
+    fd = mkstemp(tmp);
+    if (fd == -1) {
+        perror("mkstemp");
+        return -1;
+    }
+    if (fchmod(fd, mode) == -1) {
+        perror("fchmod");
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    return fd;
+}
+
+
+/* Sync the destination filesystem, then rename the num files of batch into
+ * place, and free it. This runs without lock, so other threads can keep
+ * queueing files while the sync runs. sync_fd must be set.
+ */
+static void flush_batch(struct pending *batch, int num) {
+    int errors = 0;
+
+    // If the data may not be on disk, renaming would risk replacing a good
+    // file with a broken one, so the new copies are dropped.
+    int synced = syncfs(sync_fd) == 0;
+    if (!synced) {
+        perror("syncfs");
+    }
+    for (int i = 0; i < num; i++) {
+        if (!synced || rename(batch[i].tmp, batch[i].dest) == -1) {
+            if (synced) {
+                perror("rename");
+            }
+            unlink(batch[i].tmp);
+            *batch[i].failed = 1;
+            errors++;
+
+        // The journal syncs again before writing this, so the rename is on
+        // disk before the record is.
+        } else {
+            journal_add(batch[i].dest, batch[i].src_st,
+                        batch[i].src_st->st_size, -1);
+        }
+        free(batch[i].tmp);
+        free(batch[i].dest);
+    }
+    free(batch);
+
+    pthread_mutex_lock(&lock);
+    failed += errors;
+    pthread_mutex_unlock(&lock);
+}
+
+
+/* Take every queued file off the queue, and return them, with their number
+ * in *num. lock must be held.
+ */
+static struct pending *take_queue(int *num) {
+    struct pending *batch = queue;
+
+    *num = num_pending;
+    queue = NULL;
+    num_pending = 0;
+    max_pending = 0;
+    pending_bytes = 0;
+    return batch;
+}
+
+
+int atomic_commit(int fd, const char *tmp, const char *dest,
+                  const struct stat *src_st, long long batch_bytes,
+                  int *rename_failed) {
+    struct pending *batch = NULL;
+    int num = 0;
+    struct stat st;
+
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        unlink(tmp);
+        return -1;
+    }
+
+    pthread_mutex_lock(&lock);
+    if (sync_fd == -1) {
+        sync_fd = dup(fd);
+        sync_dev = st.st_dev;
+    }
+
+    // syncfs on sync_fd won't reach this file, so sync it now.
+    if (st.st_dev != sync_dev && fsync(fd) == -1) {
+        perror("fsync");
+        unlink(tmp);
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+
+    if (num_pending == max_pending) {
+        max_pending = max_pending ? max_pending * 2 : QUEUE_INITIAL;
+        queue = realloc(queue, max_pending * sizeof(struct pending));
+        if (queue == NULL) {
+            perror("realloc");
+            exit(-1);
+        }
+    }
+    queue[num_pending].tmp = strdup(tmp);
+    queue[num_pending].dest = strdup(dest);
+    if (queue[num_pending].tmp == NULL || queue[num_pending].dest == NULL) {
+        perror("strdup");
+        exit(-1);
+    }
+    queue[num_pending].src_st = src_st;
+    queue[num_pending].failed = rename_failed;
+    num_pending++;
+    pending_bytes += src_st->st_size;
+
+    if (batch_bytes > 0 && pending_bytes >= batch_bytes) {
+        batch = take_queue(&num);
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (batch != NULL) {
+        flush_batch(batch, num);
+    }
+    return 0;
+}
+
+
+int atomic_flush(void) {
+    struct pending *batch;
+    int num, errors;
+
+    // Nothing else is queueing files by now.
+    pthread_mutex_lock(&lock);
+    batch = take_queue(&num);
+    pthread_mutex_unlock(&lock);
+    if (num > 0) {
+        flush_batch(batch, num);
+    } else {
+        free(batch);
+    }
+
+    pthread_mutex_lock(&lock);
+    errors = failed;
+    failed = 0;
+
+    // The renames are only safe once they reach the disk too.
+    if (sync_fd != -1) {
+        if (syncfs(sync_fd) == -1) {
+            perror("syncfs");
+        }
+        close(sync_fd);
+        sync_fd = -1;
+    }
+    pthread_mutex_unlock(&lock);
+    return errors;
+}
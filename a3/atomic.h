@@ -0,0 +1,32 @@
+#ifndef _ATOMIC_H_
+#define _ATOMIC_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Create a new, empty temporary file in the same directory as dest, with the
+ * permission bits mode, and copy its path into tmp, which holds PATH_MAX
+ * bytes. Return an fd open for writing, or -1 on error.
+ */
+int atomic_open(const char *dest, mode_t mode, char *tmp);
+
+/* Queue the finished temporary file tmp, open as fd, to be renamed over
+ * dest. Renames wait until the data is on disk, so after a crash dest holds
+ * either its old or its new contents. Queued files are synced and renamed
+ * together once batch_bytes of them have built up, or by atomic_flush. Once
+ * renamed, dest is recorded in the journal as copied from the source src_st
+ * describes, which must stay valid until then. If the rename fails,
+ * *rename_failed is set instead.
+ * Return 0 on success, or -1 on error, in which case tmp has been removed.
+ */
+int atomic_commit(int fd, const char *tmp, const char *dest,
+                  const struct stat *src_st, long long batch_bytes,
+                  int *rename_failed);
+
+/* Sync and rename every queued file, then sync again so the renames last.
+ * Return the number of files, queued since the last call, that could not be
+ * renamed.
+ */
+int atomic_flush(void);
+
+#endif // _ATOMIC_H_
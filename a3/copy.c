@@ -0,0 +1,627 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <linux/fs.h>
+#include "copy.h"
+
+// Largest request handed to copy_file_range and sendfile in one call.
+#define COPY_CHUNK (1 << 30)
+
+
+/* Return 1 if errno says the method is unusable for this pair of files and
+ * the next method should be tried, or 0 if it is a real error.
+ */
+static int unsupported(int err) {
+    return err == EOPNOTSUPP || err == ENOTTY || err == EXDEV ||
+           err == EINVAL || err == ENOSYS || err == EBADF || err == EPERM;
+}
+
+
+int clone_data(int src_fd, int dest_fd) {
+#ifdef FICLONE
+    if (ioctl(dest_fd, FICLONE, src_fd) == 0) {
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+
+/* Copy the bytes from *done up to end with copy_file_range. Return 0 when the
+ * copy is complete, 1 if the method is unsupported, or -1 on error.
+ */
+static int try_copy_range(int src_fd, int dest_fd, off_t end, off_t *done) {
+    off_t start = *done;
+
+    while (*done < end) {
+        loff_t in_off = *done, out_off = *done;
+        size_t len = end - *done > COPY_CHUNK ? COPY_CHUNK : end - *done;
+        ssize_t n = copy_file_range(src_fd, &in_off, dest_fd, &out_off, len, 0);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (*done == start && unsupported(errno)) {
+                return 1;
+            }
+            perror("copy_file_range");
+            return -1;
+        }
+        // The source shrank while we were copying it.
+        if (n == 0) {
+            break;
+        }
+        *done += n;
+    }
+    return 0;
+}
+
+
+/* Copy the bytes from *done up to end with sendfile. Return 0 when the copy
+ * is complete, 1 if the method is unsupported, or -1 on error.
+ */
+static int try_sendfile(int src_fd, int dest_fd, off_t end, off_t *done) {
+    off_t start = *done;
+
+    // sendfile writes at the current offset of dest_fd.
+    if (lseek(dest_fd, *done, SEEK_SET) == -1) {
+        perror("lseek");
+        return -1;
+    }
+
+    while (*done < end) {
+        off_t in_off = *done;
+        size_t len = end - *done > COPY_CHUNK ? COPY_CHUNK : end - *done;
+        ssize_t n = sendfile(dest_fd, src_fd, &in_off, len);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (*done == start && unsupported(errno)) {
+                return 1;
+            }
+            perror("sendfile");
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        *done += n;
+    }
+    return 0;
+}
+
+
+/* Return 1 if all len bytes of buf are zero, or 0 otherwise.
+ */
+static int all_zero(const char *buf, size_t len) {
+    return len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+
+/* Return a COPY_BUFSIZE buffer aligned for O_DIRECT, or NULL on error.
+ */
+static char *alloc_buffer(void) {
+    void *buf;
+    int err = posix_memalign(&buf, DIRECT_ALIGN, COPY_BUFSIZE);
+
+    if (err != 0) {
+        errno = err;
+        perror("posix_memalign");
+        return NULL;
+    }
+    return buf;
+}
+
+
+/* Turn O_DIRECT on or off for fd. Return 0 on success, or -1 on error.
+ */
+static int set_direct(int fd, int on) {
+    int fl = fcntl(fd, F_GETFL);
+
+    if (fl == -1) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, on ? fl | O_DIRECT : fl & ~O_DIRECT);
+}
+
+
+/* Write back the bytes of dest_fd from offset to offset + len, then drop them
+ * and the matching source bytes from the page cache.
+ */
+static void drop_behind(int src_fd, int dest_fd, off_t offset, off_t len) {
+    sync_file_range(dest_fd, offset, len, SYNC_FILE_RANGE_WAIT_BEFORE |
+                    SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(dest_fd, offset, len, POSIX_FADV_DONTNEED);
+    posix_fadvise(src_fd, offset, len, POSIX_FADV_DONTNEED);
+}
+
+
+/* Copy the bytes from *done up to end through a large aligned buffer.
+ * flags is a mix of:
+ *   COPY_PUNCH_ZEROS - ZERO_RUN sized blocks of zeros are not written,
+ *                      leaving holes in dest_fd.
+ *   COPY_DROP_CACHE - Each chunk is dropped from the page cache once written.
+ *   COPY_DIRECT - Both files are accessed with O_DIRECT, except for a tail
+ *                 that is not a multiple of DIRECT_ALIGN.
+ * Return 0 on success, or -1 on error.
+ */
+static int copy_read_write(int src_fd, int dest_fd, off_t end, off_t *done,
+                           int flags) {
+    off_t last = -1, last_len = 0;
+    char *buf = alloc_buffer();
+    if (buf == NULL) {
+        return -1;
+    }
+
+    // Not every filesystem takes O_DIRECT, so drop the cache instead.
+    if (flags & COPY_DIRECT) {
+        if (*done % DIRECT_ALIGN != 0 || set_direct(src_fd, 1) == -1 ||
+            set_direct(dest_fd, 1) == -1) {
+            set_direct(src_fd, 0);
+            flags = (flags & ~COPY_DIRECT) | COPY_DROP_CACHE;
+        }
+    }
+    if (flags & (COPY_DIRECT | COPY_DROP_CACHE)) {
+        posix_fadvise(src_fd, *done, end - *done, POSIX_FADV_SEQUENTIAL);
+    }
+
+    while (*done < end) {
+        size_t len = end - *done > COPY_BUFSIZE ? COPY_BUFSIZE : end - *done;
+
+        // O_DIRECT only takes whole blocks, so the tail goes through the cache.
+        if ((flags & COPY_DIRECT) && len % DIRECT_ALIGN != 0) {
+            set_direct(src_fd, 0);
+            set_direct(dest_fd, 0);
+            flags &= ~COPY_DIRECT;
+        }
+
+        ssize_t num_read = pread(src_fd, buf, len, *done);
+        if (num_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pread");
+            free(buf);
+            return -1;
+        }
+        if (num_read == 0) {
+            break;
+        }
+
+        ssize_t num_written = 0;
+        while (num_written < num_read) {
+            size_t chunk = num_read - num_written;
+
+            // Skip over a block of zeros instead of writing it.
+            if (flags & COPY_PUNCH_ZEROS) {
+                chunk = chunk > ZERO_RUN ? ZERO_RUN : chunk;
+                if (chunk == ZERO_RUN && all_zero(buf + num_written, chunk)) {
+                    num_written += chunk;
+                    continue;
+                }
+            }
+
+            ssize_t n = pwrite(dest_fd, buf + num_written, chunk,
+                               *done + num_written);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("pwrite");
+                free(buf);
+                return -1;
+            }
+            num_written += n;
+        }
+
+        // Start writing this chunk back, and drop the one before it, which
+        // has had a whole chunk's time to reach the disk.
+        if (flags & COPY_DROP_CACHE) {
+            sync_file_range(dest_fd, *done, num_read, SYNC_FILE_RANGE_WRITE);
+            if (last != -1) {
+                drop_behind(src_fd, dest_fd, last, last_len);
+            }
+            last = *done;
+            last_len = num_read;
+        }
+        *done += num_read;
+    }
+
+    if (last != -1) {
+        drop_behind(src_fd, dest_fd, last, last_len);
+    }
+    if (flags & COPY_DIRECT) {
+        set_direct(src_fd, 0);
+        set_direct(dest_fd, 0);
+    }
+    free(buf);
+    return 0;
+}
+
+
+/* Copy the bytes from start up to end, using *method or, if it turns out to
+ * be unsupported, the next slower one. *method is left at the method that
+ * worked so later extents of the same file go straight to it. flags are as
+ * for copy_read_write.
+ * Return 0 on success, or -1 on error.
+ */
+static int copy_extent(int src_fd, int dest_fd, off_t start, off_t end,
+                       int *method, int flags) {
+    off_t done = start;
+    int result;
+
+    // Only the read/write path looks at the data or controls the cache.
+    if (flags & (COPY_PUNCH_ZEROS | COPY_DROP_CACHE | COPY_DIRECT)) {
+        *method = COPY_READWRITE;
+    }
+
+    if (*method == COPY_RANGE) {
+        if ((result = try_copy_range(src_fd, dest_fd, end, &done)) <= 0) {
+            return result;
+        }
+        *method = COPY_SENDFILE;
+    }
+
+    if (*method == COPY_SENDFILE) {
+        if ((result = try_sendfile(src_fd, dest_fd, end, &done)) <= 0) {
+            return result;
+        }
+        *method = COPY_READWRITE;
+    }
+
+    return copy_read_write(src_fd, dest_fd, end, &done, flags);
+}
+
+
+/* Copy only the data extents of src_fd, found with SEEK_DATA and SEEK_HOLE,
+ * so its holes stay holes in dest_fd. Return 0 on success, 1 if the
+ * filesystem can't report holes, or -1 on error.
+ */
+static int copy_sparse(int src_fd, int dest_fd, off_t size, int *method,
+                       int flags) {
+    off_t data = 0, hole;
+
+    while (data < size) {
+        if ((data = lseek(src_fd, data, SEEK_DATA)) == -1) {
+            // No data past this point, only a trailing hole.
+            if (errno == ENXIO) {
+                break;
+            }
+            if (errno == EINVAL || errno == EOPNOTSUPP) {
+                return 1;
+            }
+            perror("lseek");
+            return -1;
+        }
+        if (data >= size) {
+            break;
+        }
+
+        if ((hole = lseek(src_fd, data, SEEK_HOLE)) == -1) {
+            perror("lseek");
+            return -1;
+        }
+        if (hole > size) {
+            hole = size;
+        }
+
+        if (copy_extent(src_fd, dest_fd, data, hole, method, flags) == -1) {
+            return -1;
+        }
+        data = hole;
+    }
+    return 0;
+}
+
+
+int copy_data(int src_fd, int dest_fd, off_t size, int flags) {
+    struct stat src_st;
+    int method = COPY_RANGE, holes = 0, result;
+    int punch = flags & COPY_PUNCH_ZEROS;
+
+    if (size == 0) {
+        return COPY_NONE;
+    }
+
+    if (clone_data(src_fd, dest_fd) == 0) {
+        return COPY_CLONE;
+    }
+
+    // A file with fewer blocks than its size needs has holes to keep.
+    if (fstat(src_fd, &src_st) == 0 && src_st.st_blocks * 512 < size) {
+        result = copy_sparse(src_fd, dest_fd, size, &method, flags);
+        if (result == -1) {
+            return -1;
+        }
+        holes = result == 0;
+    }
+
+    if (!holes) {
+        // Reserve all the space up front so the file is not built up in
+        // fragments. Filesystems without fallocate just skip this.
+        if (!punch && fallocate(dest_fd, FALLOC_FL_KEEP_SIZE, 0, size) == -1 &&
+            errno == ENOSPC) {
+            perror("fallocate");
+            return -1;
+        }
+        if (copy_extent(src_fd, dest_fd, 0, size, &method, flags) == -1) {
+            return -1;
+        }
+    }
+
+    // Set the size, since trailing holes and skipped zeros were not written.
+    if (holes || punch) {
+        if (ftruncate(dest_fd, size) == -1) {
+            perror("ftruncate");
+            return -1;
+        }
+        method |= COPY_HOLES;
+    }
+    return method;
+}
+
+
+int copy_part(int src_fd, int dest_fd, off_t start, off_t end, int flags) {
+    int method = COPY_RANGE;
+
+    if (copy_extent(src_fd, dest_fd, start, end, &method, flags) == -1) {
+        return -1;
+    }
+    return method;
+}
+
+
+off_t stream_data(int in_fd, int out_fd, off_t size) {
+    int method = COPY_RANGE;
+    off_t done = 0;
+    char *buf = NULL;
+
+    while (done < size) {
+        size_t len = size - done > COPY_CHUNK ? COPY_CHUNK : size - done;
+        ssize_t n;
+
+        // Each method is dropped for the next as soon as it turns out not to
+        // work for this pair of files: copy_file_range needs two regular
+        // files, splice needs a pipe on one side, and sendfile needs a
+        // source it can map.
+        if (method == COPY_RANGE) {
+            n = copy_file_range(in_fd, NULL, out_fd, NULL, len, 0);
+        } else if (method == COPY_SPLICE) {
+            n = splice(in_fd, NULL, out_fd, NULL, len, SPLICE_F_MOVE);
+        } else if (method == COPY_SENDFILE) {
+            n = sendfile(out_fd, in_fd, NULL, len);
+        } else {
+            if (buf == NULL && (buf = alloc_buffer()) == NULL) {
+                return -1;
+            }
+            n = read(in_fd, buf, len > COPY_BUFSIZE ? COPY_BUFSIZE : len);
+            for (ssize_t written = 0; n > 0 && written < n; ) {
+                ssize_t w = write(out_fd, buf + written, n - written);
+                if (w < 0 && errno != EINTR) {
+                    perror("write");
+                    free(buf);
+                    return -1;
+                }
+                written += w > 0 ? w : 0;
+            }
+        }
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (method != COPY_READWRITE && unsupported(errno)) {
+                method = method == COPY_RANGE ? COPY_SPLICE :
+                         method == COPY_SPLICE ? COPY_SENDFILE : COPY_READWRITE;
+                continue;
+            }
+            perror(copy_method_name(method));
+            free(buf);
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+
+    free(buf);
+    return done;
+}
+
+
+/* Read up to count bytes at offset into buf, retrying short reads. Return the
+ * number of bytes read, which is less than count only at end of file, or -1
+ * on error.
+ */
+static ssize_t pread_full(int fd, char *buf, size_t count, off_t offset) {
+    size_t total = 0;
+
+    while (total < count) {
+        ssize_t n = pread(fd, buf + total, count - total, offset + total);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pread");
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
+
+/* Write all count bytes of buf at offset. Return 0 on success, -1 on error.
+ */
+static int pwrite_full(int fd, const char *buf, size_t count, off_t offset) {
+    size_t total = 0;
+
+    while (total < count) {
+        ssize_t n = pwrite(fd, buf + total, count - total, offset + total);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pwrite");
+            return -1;
+        }
+        total += n;
+    }
+    return 0;
+}
+
+
+off_t delta_data(int src_fd, int dest_fd, off_t size) {
+    struct stat dest_st;
+    off_t offset = 0, written = 0;
+    char *src_buf = alloc_buffer();
+    char *dest_buf = alloc_buffer();
+
+    if (src_buf == NULL || dest_buf == NULL) {
+        free(src_buf);
+        free(dest_buf);
+        return -1;
+    }
+
+    while (offset < size) {
+        ssize_t src_read = pread_full(src_fd, src_buf, COPY_BUFSIZE, offset);
+        ssize_t dest_read = pread_full(dest_fd, dest_buf, COPY_BUFSIZE, offset);
+        if (src_read < 0 || dest_read < 0) {
+            written = -1;
+            break;
+        }
+        if (src_read == 0) {
+            break;
+        }
+
+        // Find runs of differing blocks and rewrite each run with one pwrite.
+        ssize_t run_start = -1;
+        for (ssize_t block = 0; block < src_read; block += DELTA_BLOCK) {
+            ssize_t len = src_read - block < DELTA_BLOCK ?
+                          src_read - block : DELTA_BLOCK;
+            int differs = block + len > dest_read ||
+                          memcmp(src_buf + block, dest_buf + block, len) != 0;
+
+            if (differs && run_start == -1) {
+                run_start = block;
+            }
+
+            // Write out the run once it ends, or at the end of the buffer.
+            if (run_start != -1 && (!differs || block + len == src_read)) {
+                ssize_t run_end = differs ? block + len : block;
+                if (pwrite_full(dest_fd, src_buf + run_start,
+                                run_end - run_start, offset + run_start) == -1) {
+                    written = -1;
+                    break;
+                }
+                written += run_end - run_start;
+                run_start = -1;
+            }
+        }
+        if (written == -1) {
+            break;
+        }
+        offset += src_read;
+    }
+
+    free(src_buf);
+    free(dest_buf);
+    if (written == -1) {
+        return -1;
+    }
+
+    // Drop anything past the new end, or extend a file that was cut short.
+    if (fstat(dest_fd, &dest_st) == -1) {
+        perror("fstat");
+        return -1;
+    }
+    if (dest_st.st_size != offset && ftruncate(dest_fd, offset) == -1) {
+        perror("ftruncate");
+        return -1;
+    }
+    return written;
+}
+
+
+int same_data(int fd1, int fd2, off_t *compared) {
+    off_t offset = 0;
+    size_t chunk = COMPARE_FIRST;
+    int result = 1;
+    char *buf1 = alloc_buffer();
+    char *buf2 = alloc_buffer();
+
+    if (buf1 == NULL || buf2 == NULL) {
+        free(buf1);
+        free(buf2);
+        return -1;
+    }
+
+    // Both files are read front to back, so let readahead run ahead.
+    posix_fadvise(fd1, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd2, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    while (result == 1) {
+        ssize_t num_read1 = pread_full(fd1, buf1, chunk, offset);
+        ssize_t num_read2 = pread_full(fd2, buf2, chunk, offset);
+        if (num_read1 < 0 || num_read2 < 0) {
+            result = -1;
+            break;
+        }
+        if (num_read1 != num_read2 || memcmp(buf1, buf2, num_read1) != 0) {
+            result = 0;
+        } else if (num_read1 == 0) {
+            break;
+        }
+        offset += num_read1 > num_read2 ? num_read1 : num_read2;
+
+        // Most files that differ do so near the start, so begin small and
+        // grow the reads to the full buffer once the files keep matching.
+        if (chunk < COPY_BUFSIZE) {
+            chunk *= 2;
+        }
+    }
+
+    if (compared != NULL) {
+        *compared = offset;
+    }
+    free(buf1);
+    free(buf2);
+    return result;
+}
+
+
+const char *copy_method_name(int method) {
+    switch (method) {
+        case COPY_NONE:
+            return "empty";
+        case COPY_CLONE:
+            return "reflink";
+        case COPY_RANGE:
+            return "copy_file_range";
+        case COPY_SENDFILE:
+            return "sendfile";
+        case COPY_READWRITE:
+            return "read/write";
+        case COPY_DELTA:
+            return "delta";
+        case COPY_SPLICE:
+            return "splice";
+        default:
+            return "unknown";
+    }
+}
@@ -0,0 +1,85 @@
+#ifndef _COPY_H_
+#define _COPY_H_
+
+#include <sys/types.h>
+
+// Ways the copy engine can move file data, tried in this order.
+#define COPY_NONE 0
+#define COPY_CLONE 1
+#define COPY_RANGE 2
+#define COPY_SENDFILE 3
+#define COPY_READWRITE 4
+#define COPY_DELTA 5
+#define COPY_SPLICE 7            // Through a pipe, by stream_data.
+
+// Set in the method returned by copy_data when holes were kept or punched.
+#define COPY_HOLES 0x100
+
+// Flags for copy_data.
+#define COPY_PUNCH_ZEROS 1      // Leave holes for ZERO_RUN blocks of zeros.
+#define COPY_DROP_CACHE 2       // Drop copied data from the page cache.
+#define COPY_DIRECT 4           // Bypass the page cache with O_DIRECT.
+
+// Size of the buffer used by the read/write fallback.
+#define COPY_BUFSIZE (1 << 20)
+
+// Alignment of I/O buffers, offsets and lengths for O_DIRECT.
+#define DIRECT_ALIGN 4096
+
+// Size of the first reads made by same_data, which doubles up to
+// COPY_BUFSIZE.
+#define COMPARE_FIRST (64 * 1024)
+
+// Size of the blocks compared by the delta update. Divides COPY_BUFSIZE.
+#define DELTA_BLOCK (64 * 1024)
+
+// Shortest aligned run of zeros that COPY_PUNCH_ZEROS turns into a hole.
+#define ZERO_RUN (64 * 1024)
+
+/* Copy size bytes from the start of src_fd to the start of dest_fd, using the
+ * fastest method the kernel and filesystems support. dest_fd must be empty.
+ * Holes in src_fd are kept as holes in dest_fd, and otherwise the space for
+ * dest_fd is allocated up front. flags is a mix of the COPY_* flags above;
+ * any of them forces the read/write method.
+ * Return the COPY_* method that finished the copy, with COPY_HOLES set if
+ * dest_fd was left sparse, or -1 on error.
+ */
+int copy_data(int src_fd, int dest_fd, off_t size, int flags);
+
+/* Copy bytes start to end of src_fd to the same place in dest_fd, which may
+ * already hold other data. flags are as for copy_data. Holes are not kept.
+ * Return the COPY_* method that finished the copy, or -1 on error.
+ */
+int copy_part(int src_fd, int dest_fd, off_t start, off_t end, int flags);
+
+/* Move size bytes from the current offset of in_fd to the current offset of
+ * out_fd, either of which may be a pipe, with copy_file_range, splice or
+ * sendfile where they work, or read and write otherwise. Both offsets are
+ * advanced. Return the number of bytes moved, which is less than size only
+ * if in_fd ended early, or -1 on error.
+ */
+off_t stream_data(int in_fd, int out_fd, off_t size);
+
+/* Update dest_fd in place so it matches the first size bytes of src_fd. Both
+ * files are read once, only the DELTA_BLOCK sized blocks that differ are
+ * rewritten, and dest_fd is then truncated or extended to size.
+ * Return the number of bytes written, or -1 on error.
+ */
+off_t delta_data(int src_fd, int dest_fd, off_t size);
+
+/* Make dest_fd share all of src_fd's extents. Only works on filesystems with
+ * reflinks (btrfs, XFS). Return 0 on success, or -1 if unsupported.
+ */
+int clone_data(int src_fd, int dest_fd);
+
+/* Compare the contents of fd1 and fd2, reading both in step and stopping at
+ * the first chunk that differs. If compared is not NULL, the number of bytes
+ * read from each file is saved there.
+ * Return 1 if they are the same, 0 if they differ, or -1 on error.
+ */
+int same_data(int fd1, int fd2, off_t *compared);
+
+/* Return a printable name for a COPY_* method. */
+const char *copy_method_name(int method);
+
+#endif // _COPY_H_
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "dedup.h"
+#include "copy.h"
+#include "hash.h"
+#include "pool.h"
+
+
+// A file that might share its contents with another one.
+struct candidate {
+    struct plan_entry *entry;
+    unsigned long long hash;
+    int error;              // Set if the file could not be hashed.
+};
+
+
+/* Order candidates by size, then by their place in the plan.
+ */
+static int compare_size(const void *a, const void *b) {
+    const struct candidate *c1 = a, *c2 = b;
+
+    if (c1->entry->st.st_size != c2->entry->st.st_size) {
+        return c1->entry->st.st_size < c2->entry->st.st_size ? -1 : 1;
+    }
+    return c1->entry < c2->entry ? -1 : c1->entry > c2->entry;
+}
+
+
+/* Order candidates by size, then hash, then their place in the plan.
+ */
+static int compare_hash(const void *a, const void *b) {
+    const struct candidate *c1 = a, *c2 = b;
+
+    if (c1->entry->st.st_size != c2->entry->st.st_size) {
+        return c1->entry->st.st_size < c2->entry->st.st_size ? -1 : 1;
+    }
+    if (c1->hash != c2->hash) {
+        return c1->hash < c2->hash ? -1 : 1;
+    }
+    return c1->entry < c2->entry ? -1 : c1->entry > c2->entry;
+}
+
+
+/* Hash the source of a candidate. Runs on a worker thread.
+ */
+static void hash_candidate(void *item) {
+    struct candidate *c = item;
+    int fd = open(c->entry->src, O_RDONLY);
+
+    if (fd == -1) {
+        perror("open");
+        c->error = 1;
+        return;
+    }
+    if (hash_fd(fd, &c->hash) == -1) {
+        c->error = 1;
+    }
+    close(fd);
+}
+
+
+/* Return 1 if the files at path1 and path2 have the same contents, 0 if not
+ * or if they can't be read.
+ */
+static int same_file(const char *path1, const char *path2) {
+    int fd1, fd2, result = 0;
+
+    if ((fd1 = open(path1, O_RDONLY)) == -1) {
+        perror("open");
+        return 0;
+    }
+    if ((fd2 = open(path2, O_RDONLY)) == -1) {
+        perror("open");
+        close(fd1);
+        return 0;
+    }
+
+    result = same_data(fd1, fd2, NULL) == 1;
+    close(fd1);
+    close(fd2);
+    return result;
+}
+
+
+/* Turn entry into a link to primary, and move it to PLAN_LINK in the plan
+ * totals.
+ */
+static void make_link(struct plan *plan, struct plan_entry *entry,
+                      const struct plan_entry *primary) {
+    plan->count[entry->action]--;
+    plan->bytes[entry->action] -= entry->st.st_size;
+    plan->count[PLAN_LINK]++;
+    plan->bytes[PLAN_LINK] += entry->st.st_size;
+
+    entry->action = PLAN_LINK;
+    entry->link = primary->dest;
+
+    // A hard link shares the mode and times too, so it is only an exact copy
+    // if those match as well.
+    entry->link_hard = entry->st.st_mode == primary->st.st_mode &&
+                       same_mtime(&entry->st, &primary->st);
+}
+
+
+void dedup_plan(struct plan *plan, int workers) {
+    struct candidate *list = malloc(plan->num_files * sizeof(struct candidate));
+    int num = 0, kept = 0;
+
+    if (list == NULL) {
+        perror("malloc");
+        return;
+    }
+
+    // Only files whose data is about to be written can share it.
+    for (int i = 0; i < plan->num_files; i++) {
+        struct plan_entry *entry = &plan->files[i];
+        if ((entry->action == PLAN_CREATE || entry->action == PLAN_OVERWRITE) &&
+            entry->st.st_size > 0) {
+            list[num].entry = entry;
+            list[num].hash = 0;
+            list[num].error = 0;
+            num++;
+        }
+    }
+
+    // A file with a size nobody else has can't be a duplicate, so keep only
+    // files that share their size before reading anything.
+    qsort(list, num, sizeof(struct candidate), compare_size);
+    for (int i = 0; i < num; i++) {
+        off_t size = list[i].entry->st.st_size;
+        if ((i > 0 && list[i - 1].entry->st.st_size == size) ||
+            (i + 1 < num && list[i + 1].entry->st.st_size == size)) {
+            list[kept++] = list[i];
+        }
+    }
+
+    pool_run(list, sizeof(struct candidate), kept, workers, hash_candidate);
+    qsort(list, kept, sizeof(struct candidate), compare_hash);
+
+    // Each run of equal size and hash is a group. The first file of a group
+    // is copied, and the rest link to it once it is confirmed identical.
+    for (int start = 0; start < kept; ) {
+        int end = start + 1;
+        while (end < kept &&
+               list[end].entry->st.st_size == list[start].entry->st.st_size &&
+               list[end].hash == list[start].hash) {
+            end++;
+        }
+
+        if (!list[start].error) {
+            for (int i = start + 1; i < end; i++) {
+                if (!list[i].error &&
+                    same_file(list[start].entry->src, list[i].entry->src)) {
+                    make_link(plan, list[i].entry, list[start].entry);
+                }
+            }
+        }
+        start = end;
+    }
+
+    free(list);
+}
@@ -0,0 +1,14 @@
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#include "plan.h"
+
+/* Find files in plan that are about to be created or overwritten with the
+ * same contents as another such file. Files are grouped by size, then by
+ * content hash, and every match is confirmed byte for byte. All but the
+ * first file of each group become PLAN_LINK entries pointing at it. The
+ * hashing runs on workers threads.
+ */
+void dedup_plan(struct plan *plan, int workers);
+
+#endif // _DEDUP_H_
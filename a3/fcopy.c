@@ -1,21 +1,169 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
 #include "ftree.h"
+#include "stats.h"
+#include "archive.h"
+
+
+/* Print how to run fcopy.
+ */
+static void usage(void) {
+    printf("Usage:\n\tfcopy [-vdczOnPua] [-j JOBS] [-D MB] [-S MB] [-r JOURNAL] [-J FILE] SRC DEST\n");
+    printf("\tfcopy -p SRC ARCHIVE\n");
+    printf("\tfcopy -x ARCHIVE DEST\n");
+    printf("\t-v - Report the copy method used for each file\n");
+    printf("\t-d - Rewrite only the changed blocks of existing files\n");
+    printf("\t-c - Compare contents instead of size and modification time\n");
+    printf("\t-z - Leave holes for long runs of zeros in copied files\n");
+    printf("\t-D MB - Keep files of at least MB megabytes out of the page cache\n");
+    printf("\t-O - Use O_DIRECT for those files (implies -D 0 if -D is not given)\n");
+    printf("\t-n - Print what would be done, without changing anything\n");
+    printf("\t-P - Show progress and time remaining on stderr\n");
+    printf("\t-u - Copy identical files once, and reflink or hard link the rest\n");
+    printf("\t-a - Replace files atomically: copy to a temporary name, sync\n"
+           "\t     once at the end and rename into place (turns off -d)\n");
+    printf("\t-S MB - With -a, also sync and rename after every MB megabytes\n");
+    printf("\t-r JOURNAL - Skip what an interrupted run recorded in JOURNAL, and\n"
+           "\t     record progress there; removed once a copy completes\n");
+    printf("\t-J FILE - Write a JSON report of the copy to FILE (- for stdout,\n"
+           "\t     which moves the summary to stderr)\n");
+    printf("\t-j JOBS - Number of files to copy at once (default: one per CPU)\n");
+    printf("\t-p - Pack the tree SRC into the file ARCHIVE (- for stdout)\n");
+    printf("\t-x - Unpack the file ARCHIVE (- for stdin) into the directory DEST\n");
+}
 
 
 int main(int argc, char **argv) {
-    if (argc != 3) {
-        printf("Usage:\n\tfcopy SRC DEST\n");
+    int opt, pack = 0, unpack = 0;
+    
+    while ((opt = getopt(argc, argv, "vdczOnPuapxD:S:r:j:J:")) != -1) {
+        switch (opt) {
+            case 'v':
+                copy_opts.verbose = 1;
+                break;
+            case 'd':
+                copy_opts.delta = 1;
+                break;
+            case 'c':
+                copy_opts.checksum = 1;
+                break;
+            case 'z':
+                copy_opts.punch = 1;
+                break;
+            case 'D':
+                copy_opts.nocache = 1;
+                copy_opts.nocache_size = strtoll(optarg, NULL, 10) << 20;
+                break;
+            case 'O':
+                copy_opts.nocache = 1;
+                copy_opts.direct = 1;
+                break;
+            case 'n':
+                copy_opts.dry_run = 1;
+                break;
+            case 'P':
+                copy_opts.progress = 1;
+                break;
+            case 'u':
+                copy_opts.dedup = 1;
+                break;
+            case 'a':
+                copy_opts.atomic = 1;
+                break;
+            case 'S':
+                copy_opts.atomic = 1;
+                copy_opts.sync_size = strtoll(optarg, NULL, 10) << 20;
+                break;
+            case 'r':
+                copy_opts.journal = optarg;
+                break;
+            case 'p':
+                pack = 1;
+                break;
+            case 'x':
+                unpack = 1;
+                break;
+            case 'J':
+                copy_opts.report = optarg;
+                break;
+            case 'j':
+                copy_opts.jobs = strtol(optarg, NULL, 10);
+                break;
+            default:
+                usage();
+                return 0;
+        }
+    }
+    
+    if (argc - optind != 2) {
+        usage();
         return 0;
     }
 
-    int ret = copy_ftree(argv[1], argv[2]);
+    // In-place updates write straight to the destination, which an atomic
+    // replace must not do.
+    if (copy_opts.atomic) {
+        copy_opts.delta = 0;
+    }
+
+    // The archive may be going to stdout, so the summary goes to stderr.
+    if (pack || unpack) {
+        int result = pack ? archive_pack(argv[optind], argv[optind + 1]) :
+                            archive_unpack(argv[optind], argv[optind + 1]);
+        fprintf(stderr, "%s %s\n", pack ? "Pack" : "Unpack",
+                result == -1 ? "encountered errors" : "completed successfully");
+        fprintf(stderr, "%d files, %d directories, %d errors\n",
+                copy_summary.files_copied, copy_summary.dirs,
+                copy_summary.errors);
+        // Scripts must be able to tell a partial archive or unpack.
+        return result == -1 || copy_summary.errors > 0;
+    }
+
+    int ret = copy_ftree(argv[optind], argv[optind + 1]);
+    
+    // The plan has been printed, and nothing was copied.
+    if (copy_opts.dry_run) {
+        return 0;
+    }
+
+    // A report on stdout must be all that is there, so the summary goes to
+    // stderr instead.
+    FILE *out = stdout;
+    if (copy_opts.report != NULL && strcmp(copy_opts.report, "-") == 0) {
+        out = stderr;
+    }
+    
     if (ret < 0) {
-        printf("Errors encountered during copy\n");
+        fprintf(out, "Errors encountered during copy\n");
         ret = -ret;
     } else {
-        printf("Copy completed successfully\n");
+        fprintf(out, "Copy completed successfully\n");
+    }
+    fprintf(out, "%d files copied, %d up to date, %d chmod only, "
+            "%d directories, %d errors\n", copy_summary.files_copied,
+            copy_summary.files_skipped, copy_summary.files_chmod,
+            copy_summary.dirs, copy_summary.errors);
+    if (copy_opts.dedup) {
+        fprintf(out, "%d files linked, %lld bytes saved by deduplication\n",
+                copy_summary.files_linked, copy_summary.bytes_saved);
+    }
+    fprintf(out, "%d threads used\n", ret);
+
+    if (copy_opts.report != NULL) {
+        FILE *report = stdout;
+        if (strcmp(copy_opts.report, "-") != 0 &&
+            (report = fopen(copy_opts.report, "w")) == NULL) {
+            perror("fopen");
+            return 1;
+        }
+        stats_report(report);
+        if (report != stdout && fclose(report) != 0) {
+            perror("fclose");
+            return 1;
+        }
     }
-    printf("%d processes used\n", ret);
     
     return 0;
 }
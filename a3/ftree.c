@@ -1,34 +1,88 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <dirent.h>
 #include <string.h>
 #include <libgen.h>
 #include <limits.h>
-#include <sys/wait.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include "ftree.h"
 #include "hash.h"
+#include "copy.h"
+#include "plan.h"
+#include "pool.h"
+#include "dedup.h"
+#include "stats.h"
+#include "atomic.h"
+#include "journal.h"
+
+// Seconds between progress updates.
+#define PROGRESS_INTERVAL 1
 
 
 // Helper functions.
-char *hash(FILE *f);
 char * get_basename(const char *fname);
-int check_hash(char *hash1, char *hash2, int block_size);
+int copy_file(const char *src, const char *dest, const struct stat *src_st,
+              int *failed);
+off_t delta_file(const char *src, const char *dest, const struct stat *src_st);
+static int copy_chunks(int src_fd, int dest_fd, const char *dest,
+                       const struct stat *src_st, off_t offset, int flags);
+static int link_file(const struct plan_entry *entry);
+static int unshare_dest(struct plan_entry *entry);
+static void run_dir(struct plan_entry *entry);
+static void run_dir_times(struct plan_entry *entry);
+static void run_file(void *item);
+static void flush_atomic(void);
+static int set_times(int dir_fd, const char *path, const struct stat *src_st);
+static int set_mode(const char *path, const struct stat *src_st);
+static void *show_progress(void *arg);
 
 // Global variable.
-int error_flag = 1;
+struct copy_options copy_opts;
+struct copy_summary copy_summary;
+
+// Protects copy_summary, which the workers update concurrently.
+static pthread_mutex_t summary_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Signalled when the copy is over, so the progress thread stops.
+static pthread_cond_t copy_done = PTHREAD_COND_INITIALIZER;
+static int finished = 0;
+
+// The plan being carried out.
+static struct plan plan;
+
+
+/* Add one to the copy_summary counter at field.
+ */
+static void count(int *field) {
+    pthread_mutex_lock(&summary_lock);
+    (*field)++;
+    pthread_mutex_unlock(&summary_lock);
+}
+
+
+/* Count entry as an error, and remember that it failed.
+ */
+static void fail(struct plan_entry *entry) {
+    entry->failed = 1;
+    count(&copy_summary.errors);
+}
+
 
 int copy_ftree(const char *src, const char *dest) {
     struct stat src_st, dest_st;
-    
+    pthread_t progress;
+
     // Check if src is a valid path.
     if (lstat(src, &src_st) == -1) {
         perror("lstat");
         exit(EXIT_FAILURE);
     }
-    
+
     // Check if dest is a valid path, and it should not be regualr file.
     if (lstat(dest, &dest_st) == -1) {
         perror("lstat");
@@ -38,229 +92,683 @@ int copy_ftree(const char *src, const char *dest) {
         fprintf(stderr, "Destination should be a directory, not be a file.\n");
         exit(-1);
     }
-    
-    // Number of process.
-    int process_num = 1;
-    
+
     // Get the basename of src, and make a new path where the file should be
     // copied to.
     char new_path[PATH_MAX];
     strcpy(new_path, dest);
     strcat(new_path, "/");
     strcat(new_path, get_basename(src));
-    
-    // Check that if there is a file with the same name in the dest.
-    FILE *fp_dest;
-    fp_dest = fopen(new_path, "r");
-    
-    // Case 1: if src is a regualr file.
-    if (S_ISREG(src_st.st_mode)) {
-        char c;
-        int error;
-        FILE *fp_src;
-        
-        fp_src = fopen(src, "r");
-        if (fp_src == NULL) {
-            perror("fopen");
-            exit(-1);
+
+    int workers = copy_opts.jobs;
+    if (workers < 1) {
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    // The plan needs what the journal records, even for a dry run.
+    if (copy_opts.journal != NULL &&
+        journal_open(copy_opts.journal, copy_opts.dry_run) == -1) {
+        exit(-1);
+    }
+
+    // Work out everything that needs doing before changing anything.
+    long long start = stats_now();
+    plan_build(&plan, src, new_path);
+    stats_add_time(STATS_STAT, start);
+    if (copy_opts.dedup) {
+        start = stats_now();
+        dedup_plan(&plan, workers);
+        stats_add_time(STATS_HASH, start);
+    }
+    copy_summary.errors = plan.errors;
+    copy_summary.bytes_total = plan.bytes[PLAN_CREATE] +
+                               plan.bytes[PLAN_OVERWRITE] +
+                               plan.bytes[PLAN_COMPARE] +
+                               plan.bytes[PLAN_LINK];
+    copy_summary.files_total = plan.num_files;
+
+    if (copy_opts.dry_run) {
+        plan_print(&plan);
+        plan_free(&plan);
+        journal_close(0);
+        copy_summary.workers = 1;
+        return copy_summary.errors > 0 ? -1 : 1;
+    }
+
+    // Directories come first, parents before children, so every file has
+    // somewhere to go.
+    for (int i = 0; i < plan.num_dirs; i++) {
+        run_dir(&plan.dirs[i]);
+    }
+
+    if (copy_opts.progress &&
+        pthread_create(&progress, NULL, show_progress, NULL) != 0) {
+        perror("pthread_create");
+        copy_opts.progress = 0;
+    }
+
+    // Then the files, in the order that reads the source most sequentially.
+    // Links come last, in a second pass, once the files they point at are
+    // all in place.
+    int num_copies = plan.num_files - plan.count[PLAN_LINK];
+    plan_sort(&plan);
+    workers = pool_run(plan.files, sizeof(struct plan_entry), num_copies,
+                       workers, run_file);
+    if (workers == -1) {
+        exit(-1);
+    }
+    flush_atomic();
+    if (pool_run(plan.files + num_copies, sizeof(struct plan_entry),
+                 plan.count[PLAN_LINK], workers, run_file) == -1) {
+        exit(-1);
+    }
+    flush_atomic();
+
+    // Creating the files changed the times of their directories, so those
+    // are set last, children before their parents.
+    for (int i = plan.num_dirs - 1; i >= 0; i--) {
+        run_dir_times(&plan.dirs[i]);
+    }
+
+    if (copy_opts.progress) {
+        pthread_mutex_lock(&summary_lock);
+        finished = 1;
+        pthread_cond_signal(&copy_done);
+        pthread_mutex_unlock(&summary_lock);
+        pthread_join(progress, NULL);
+    }
+    plan_free(&plan);
+
+    // Once everything has been copied, there is nothing left to resume.
+    journal_close(copy_summary.errors == 0);
+
+    // The planning thread counts as a worker too.
+    copy_summary.workers = workers + 1;
+
+    return (copy_summary.errors > 0 ? -1 : 1) * copy_summary.workers;
+}
+
+
+/* With atomic replace on, sync and rename every copy that is waiting, so
+ * links can be made to them and the copy is durable.
+ */
+static void flush_atomic(void) {
+    if (copy_opts.atomic) {
+        int errors = atomic_flush();
+
+        // Those files were counted as copied when they were queued.
+        pthread_mutex_lock(&summary_lock);
+        copy_summary.errors += errors;
+        copy_summary.files_copied -= errors;
+        pthread_mutex_unlock(&summary_lock);
+    }
+}
+
+
+/* Print a line on stderr saying how far the copy has got and how long the
+ * rest should take, based on the plan totals, until the copy is over.
+ */
+static void *show_progress(void *arg) {
+    struct timespec start, now, wake;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(&summary_lock);
+    while (!finished) {
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec += PROGRESS_INTERVAL;
+        pthread_cond_timedwait(&copy_done, &summary_lock, &wake);
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double elapsed = (now.tv_sec - start.tv_sec) +
+                         (now.tv_nsec - start.tv_nsec) / 1e9;
+        long long done = copy_summary.bytes_done;
+        long long total = copy_summary.bytes_total;
+        int percent = total > 0 ? (int)(done * 100 / total) : 100;
+
+        fprintf(stderr, "\r%d/%d files, %lld/%lld MB, %d%%, "
+                "%.0f files/s, %.1f MB/s", copy_summary.files_done,
+                copy_summary.files_total, done >> 20, total >> 20, percent,
+                elapsed > 0 ? copy_summary.files_done / elapsed : 0,
+                elapsed > 0 ? done / elapsed / (1 << 20) : 0);
+        if (done > 0 && done < total) {
+            fprintf(stderr, ", ETA %.0fs ", elapsed * (total - done) / done);
         }
-        
-        // Case 1.1: There is not a file with the same name is in the dest.
-        if (fp_dest == NULL) {
-            // Create a copy of src in the dest.
-            fp_dest = fopen(new_path, "w");
-            
-            while(fread(&c, sizeof(char), 1, fp_src)) {
-                fwrite(&c, sizeof(char), 1, fp_dest);
-            }
-            
-            error = fclose(fp_dest);
-            error += fclose(fp_src);
-            if (error != 0) {
-                perror("fclose");
-                exit(-1);
-            }
-        
-        // Case 1.2: There is a file with the same name is in the dest.
-        } else {
-            struct stat new_copy_st;
+    }
+    pthread_mutex_unlock(&summary_lock);
+    fprintf(stderr, "\n");
+    return NULL;
+}
 
-            if (lstat(new_path, &new_copy_st) == -1) {
-                perror("lstat");
-                exit(EXIT_FAILURE);
-            }
-            
-            // If the file and the directory have the same name, then there is
-            // a mismatch error.
-            if(S_ISDIR(new_copy_st.st_mode)) {
-                fprintf(stderr,
-                        "Error Mismatch between source and destination:\n%s\n%s\n",
-                        src, new_path);
-                exit(-1);
+
+/* Carry out the plan for one directory.
+ */
+static void run_dir(struct plan_entry *entry) {
+    long long start = stats_now();
+
+    switch (entry->action) {
+        // Make a new directory in dest, if it doesn't exist.
+        case PLAN_CREATE:
+            if (mkdir(entry->dest, (entry->st.st_mode &
+                                    (S_IRWXU | S_IRWXG | S_IRWXO)))) {
+                perror("mkdir");
+                fail(entry);
+                return;
             }
-            
-            int copy_pass = 0;
-            
-            // Check difference of sizes.
-            if(new_copy_st.st_size != src_st.st_size) {
-                copy_pass += 1;
+            stats_add_time(STATS_META, start);
+            break;
+
+        // The directory is already there, then change the chmod.
+        case PLAN_CHMOD:
+            if (set_mode(entry->dest, &entry->st) == -1) {
+                fail(entry);
+                return;
             }
-            
-            // Check difference of hash value.
-            if (copy_pass == 0) {
-                char hash_src[9];
-                strncpy(hash_src, hash(fp_src), 9);
-                char hash_dest[9];
-                strncpy(hash_dest, hash(fp_dest), 9);
-                copy_pass += check_hash(hash_src, hash_dest, 8);
+            break;
+
+        case PLAN_MISMATCH:
+            fprintf(stderr,
+                    "Error Mismatch between source and destination:\n%s\n%s\n",
+                    entry->src, entry->dest);
+            fail(entry);
+            return;
+    }
+    count(&copy_summary.dirs);
+}
+
+
+/* Give the directory of entry the times of its source, once nothing more
+ * will be created in it, so the next quick check holds for it too.
+ */
+static void run_dir_times(struct plan_entry *entry) {
+    if (!entry->failed &&
+        set_times(AT_FDCWD, entry->dest, &entry->st) == -1) {
+        count(&copy_summary.errors);
+    }
+}
+
+
+/* Return 1 if the files at path1 and path2 have the same contents, 0 if they
+ * differ, or -1 on error. Reading stops at the first difference.
+ */
+static int same_contents(const char *path1, const char *path2) {
+    int fd1, fd2, result;
+    off_t compared = 0;
+
+    if ((fd1 = open(path1, O_RDONLY)) == -1) {
+        perror("open");
+        return -1;
+    }
+    if ((fd2 = open(path2, O_RDONLY)) == -1) {
+        perror("open");
+        close(fd1);
+        return -1;
+    }
+
+    result = same_data(fd1, fd2, &compared);
+    if (result == -1) {
+        fprintf(stderr, "Error comparing %s and %s\n", path1, path2);
+    }
+    stats_add_bytes(2 * (long long)compared, 0);
+
+    if (close(fd1) + close(fd2) != 0) {
+        perror("close");
+        return -1;
+    }
+    return result;
+}
+
+
+/* Give the file at path (relative to dir_fd), or dir_fd itself if path is
+ * NULL, the access and modification times in src_st.
+ * Return 0 on success, or -1 on error.
+ */
+static int set_times(int dir_fd, const char *path, const struct stat *src_st) {
+    struct timespec times[2] = {src_st->st_atim, src_st->st_mtim};
+    long long start = stats_now();
+
+    if (path == NULL) {
+        if (futimens(dir_fd, times) == -1) {
+            perror("futimens");
+            return -1;
+        }
+    } else if (utimensat(dir_fd, path, times, AT_SYMLINK_NOFOLLOW) == -1) {
+        perror("utimensat");
+        return -1;
+    }
+    stats_add_time(STATS_META, start);
+    return 0;
+}
+
+
+/* Give the file at path the permission bits in src_st.
+ * Return 0 on success, or -1 on error.
+ */
+static int set_mode(const char *path, const struct stat *src_st) {
+    long long start = stats_now();
+
+    if (chmod(path, src_st->st_mode & (S_IRWXU | S_IRWXG | S_IRWXO)) == -1) {
+        perror("chmod");
+        return -1;
+    }
+    stats_add_time(STATS_META, start);
+    return 0;
+}
+
+
+/* Carry out the plan for one regular file. Runs on a worker thread.
+ */
+static void run_file(void *item) {
+    struct plan_entry *entry = item;
+    int copy_pass = 1;
+    off_t written;
+    long long start = stats_now();
+
+    // A destination that is hard linked elsewhere must not be changed in
+    // place, or the other names would change with it.
+    if (entry->action == PLAN_CHMOD || entry->action == PLAN_OVERWRITE ||
+        entry->action == PLAN_COMPARE) {
+        if (unshare_dest(entry) == -1) {
+            fail(entry);
+            goto done;
+        }
+    }
+
+    switch (entry->action) {
+        case PLAN_MISMATCH:
+            fprintf(stderr,
+                    "Error Mismatch between source and destination:\n%s\n%s\n",
+                    entry->src, entry->dest);
+            fail(entry);
+            break;
+
+        case PLAN_SKIP:
+            count(&copy_summary.files_skipped);
+            break;
+
+        case PLAN_CHMOD:
+            if (set_mode(entry->dest, &entry->st) == -1) {
+                fail(entry);
+            } else {
+                count(&copy_summary.files_chmod);
+                journal_add(entry->dest, &entry->st, entry->st.st_size, -1);
             }
-            
-            // If size or hash value is different, then overwriting the old
-            // file.
-            if (copy_pass != 0) {
-                fp_dest = freopen(new_path, "w", fp_dest);
-                
-                if (fp_dest == NULL) {
-                    perror("freopen");
-                    exit(-1);
+            break;
+
+        // Same size and -c was given. The delta pass compares the contents
+        // itself; otherwise compare them first.
+        case PLAN_COMPARE:
+            if (!copy_opts.delta) {
+                long long hash_start = stats_now();
+                int same = same_contents(entry->src, entry->dest);
+                stats_add_time(STATS_HASH, hash_start);
+                if (same == -1) {
+                    fail(entry);
+                    break;
                 }
-                
-                while(fread(&c, sizeof(char), 1, fp_src)) {
-                    fwrite(&c, sizeof(char), 1, fp_dest);
+                copy_pass = !same;
+            }
+            // Fall through.
+
+        case PLAN_OVERWRITE:
+            // In delta mode, one pass over both files finds and rewrites
+            // only the blocks that differ.
+            if (copy_pass && copy_opts.delta) {
+                written = delta_file(entry->src, entry->dest, &entry->st);
+                if (written == -1) {
+                    fail(entry);
+                    break;
                 }
-                
-                error = fclose(fp_src);
-                error += fclose(fp_dest);
-                if (error != 0) {
-                    perror("fclose");
-                    exit(-1);
+                count(written > 0 || entry->action == PLAN_OVERWRITE ?
+                      &copy_summary.files_copied :
+                      &copy_summary.files_skipped);
+
+            // The contents match, so make sure the next quick check sees
+            // that too.
+            } else if (!copy_pass) {
+                if (set_times(AT_FDCWD, entry->dest, &entry->st) == -1) {
+                    fail(entry);
+                    break;
                 }
+                count(&copy_summary.files_skipped);
+                journal_add(entry->dest, &entry->st, entry->st.st_size, -1);
+
+            // If the files differ, then overwriting the old file.
+            } else if (copy_file(entry->src, entry->dest, &entry->st,
+                                 &entry->failed) == -1) {
+                fail(entry);
+                break;
+            } else {
+                count(&copy_summary.files_copied);
+            }
+
+            // Update chmod. An atomic copy has its mode already, and dest is
+            // still the old file until the copy is renamed over it.
+            if (!(copy_opts.atomic && copy_pass) &&
+                set_mode(entry->dest, &entry->st) == -1) {
+                fail(entry);
+            }
+            break;
+
+        // Same contents as a file copied in the first pass, so share its
+        // data instead of copying it again. If that copy failed, there is
+        // nothing sound to share, and this one is copied from its own source.
+        case PLAN_LINK:
+            if (entry->primary != NULL && !entry->primary->failed &&
+                link_file(entry) == 0) {
+                pthread_mutex_lock(&summary_lock);
+                copy_summary.files_linked++;
+                copy_summary.bytes_saved += entry->st.st_size;
+                pthread_mutex_unlock(&summary_lock);
+                journal_add(entry->dest, &entry->st, entry->st.st_size, -1);
+            } else if (copy_file(entry->src, entry->dest, &entry->st,
+                                 &entry->failed) == -1) {
+                fail(entry);
+            } else {
+                count(&copy_summary.files_copied);
             }
-            
-            // Update chmod.
-            if (chmod(new_path, (src_st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO)
-                                 ))) {
-                perror("chmod");
-                exit(-1);
+            break;
+
+        // Create a copy of src in the dest.
+        case PLAN_CREATE:
+            if (copy_file(entry->src, entry->dest, &entry->st,
+                          &entry->failed) == -1) {
+                fail(entry);
+            } else {
+                count(&copy_summary.files_copied);
             }
+            break;
+    }
+
+done:
+    stats_add_file(entry->src, stats_now() - start);
+
+    // Record the progress made against the plan totals, which count the
+    // bytes of the same actions.
+    pthread_mutex_lock(&summary_lock);
+    copy_summary.files_done++;
+    if (entry->action == PLAN_CREATE || entry->action == PLAN_OVERWRITE ||
+        entry->action == PLAN_COMPARE || entry->action == PLAN_LINK) {
+        copy_summary.bytes_done += entry->st.st_size;
+    }
+    pthread_mutex_unlock(&summary_lock);
+}
+
+
+/* Copy the contents of the regular file src to dest, creating or truncating
+ * dest as needed. With an atomic replace, *failed is set if the copy can't be
+ * renamed into place later on. Return 0 on success, or -1 on error.
+ */
+int copy_file(const char *src, const char *dest, const struct stat *src_st,
+              int *failed) {
+    int src_fd, dest_fd, method, flags, chunked;
+    char tmp[PATH_MAX];
+    off_t offset = 0;
+
+    src_fd = open(src, O_RDONLY);
+    if (src_fd == -1) {
+        perror("open");
+        return -1;
+    }
+
+    // Keep big files from pushing everything else out of the page cache.
+    flags = copy_opts.punch ? COPY_PUNCH_ZEROS : 0;
+    if (copy_opts.nocache && src_st->st_size >= copy_opts.nocache_size) {
+        flags |= copy_opts.direct ? COPY_DIRECT : COPY_DROP_CACHE;
+    }
+
+    // With a journal, large files without holes are copied in checkpointed
+    // pieces, so a later run can carry on where this one stopped.
+    chunked = copy_opts.journal != NULL && !copy_opts.atomic &&
+              src_st->st_size >= JOURNAL_LARGE && !copy_opts.punch &&
+              src_st->st_blocks * 512 >= src_st->st_size;
+
+    // For an atomic replace, the copy is built under a temporary name and
+    // dest is only touched by the final rename.
+    if (copy_opts.atomic) {
+        dest_fd = atomic_open(dest, src_st->st_mode &
+                              (S_IRWXU | S_IRWXG | S_IRWXO), tmp);
+    } else {
+        dest_fd = open(dest, chunked ? O_RDWR | O_CREAT :
+                       O_WRONLY | O_CREAT | O_TRUNC,
+                       src_st->st_mode & (S_IRWXU | S_IRWXG | S_IRWXO));
+        if (dest_fd == -1) {
+            perror("open");
         }
-        
-    // Case 2: if src is a direcoty.
-    } else if (S_ISDIR(src_st.st_mode)) {
-        DIR* src_ptr;
-        DIR* new_dir_ptr;
-        struct dirent* src_element;
-        char src_element_path[PATH_MAX];
-        struct stat new_copy_st;
-        
-        src_ptr = opendir(src);
-        if (src_ptr == NULL) {
-            perror("opendir");
-            exit(-1);
+    }
+    if (dest_fd == -1) {
+        close(src_fd);
+        return -1;
+    }
+
+    if (chunked) {
+        offset = journal_resume(dest, src_st, dest_fd);
+        if (offset == 0 && ftruncate(dest_fd, 0) == -1) {
+            perror("ftruncate");
+            close(src_fd);
+            close(dest_fd);
+            return -1;
         }
-        
-        // If the file and the directory have the same name, then there is a
-        // mismatch error.
-        if (lstat(new_path, &new_copy_st) != -1) {
-            if(S_ISREG(new_copy_st.st_mode)) {
-                fprintf(stderr,
-                        "Error Mismatch between source and destination:\n%s\n%s\n",
-                        src, new_path);
-                exit(-1);
-            }
+    }
+
+    long long start = stats_now();
+    if (chunked) {
+        method = copy_chunks(src_fd, dest_fd, dest, src_st, offset, flags);
+    } else {
+        method = copy_data(src_fd, dest_fd, src_st->st_size, flags);
+    }
+    stats_add_time(STATS_COPY, start);
+    if (method == -1) {
+        fprintf(stderr, "Error copying %s to %s\n", src, dest);
+    } else {
+        // A clone shares the data without reading or writing it.
+        if ((method & ~COPY_HOLES) != COPY_CLONE) {
+            stats_add_bytes(src_st->st_size - offset, src_st->st_size - offset);
+        }
+        if (copy_opts.verbose && offset > 0) {
+            printf("%s: %s, resumed at %lld\n", src,
+                   copy_method_name(method), (long long)offset);
+        } else if (copy_opts.verbose) {
+            printf("%s: %s%s\n", src, copy_method_name(method & ~COPY_HOLES),
+                   method & COPY_HOLES ? ", sparse" : "");
+        }
+        // An atomic copy is journaled once it has been renamed into place.
+        if (set_times(dest_fd, NULL, src_st) == -1) {
+            method = -1;
+        } else if (!copy_opts.atomic) {
+            journal_add(dest, src_st, src_st->st_size, src_fd);
         }
+    }
 
-        // Case 2.1: Make a new directory in dest, if it doesn't exist.
-        new_dir_ptr = opendir(new_path);
-        if (new_dir_ptr == NULL) {
-            mkdir(new_path, (src_st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO)));
-        
-        // Case 2.2: The directory is already there, then change the chmod.
-        } else {
-            closedir(new_dir_ptr);
-            
-            // Update chmod.
-            if (chmod(new_path, (src_st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO)
-                                 ))) {
-                perror("chmod");
-                exit(-1);
-            }
+    if (copy_opts.atomic) {
+        if (method == -1) {
+            unlink(tmp);
+        } else if (atomic_commit(dest_fd, tmp, dest, src_st,
+                                 copy_opts.sync_size, failed) == -1) {
+            method = -1;
         }
-        
-        // Get contents in the src.
-        while((src_element = readdir(src_ptr)) != NULL) {
-            // No filename that starts with '.' should be included.
-            if (src_element->d_name[0] != '.') {
-                // Get the path of element in src.
-                strcpy(src_element_path, src);
-                strcat(src_element_path, "/");
-                strcat(src_element_path, src_element->d_name);
-                
-                if (lstat(src_element_path, &new_copy_st) == -1) {
-                    perror("lstat");
-                    exit(EXIT_FAILURE);
-                }
-                
-                // If src_element_path is a regular file, then copying it
-                // without calling fork.
-                if (S_ISREG(new_copy_st.st_mode)) {
-                    copy_ftree(src_element_path, new_path);
-                    
-                // If src_element_path is a sub-directory, then call fork to
-                // copy it.
-                } else if (S_ISDIR(new_copy_st.st_mode)) {
-                    int pid = fork();
-                    
-                    // Child process.
-                    if (pid == 0) {
-                        int child_result;
-                        child_result = copy_ftree(src_element_path, new_path);
-                        exit(child_result);
-                        
-                    // Original process.
-                    } else if (pid > 0) {
-                        // Check int status to get the result of child process.
-                        int status;
-                        
-                        // Child process copies successfully.
-                        if (wait(&status) != -1) {
-                            if (WIFEXITED(status)) {
-                                // Add the number of process, which the child
-                                // process used.
-                                char cvalue = WEXITSTATUS(status);
-                                
-                                // Errors encountered in the child process.
-                                if (cvalue < 0){
-                                    process_num += -1 * cvalue;
-                                    error_flag = -1;
-                                
-                                // Update number of processes.
-                                } else {
-                                    process_num += cvalue;
-                                }
-                            }
-                        
-                        // Error with wait.
-                        } else {
-                            perror("wait");
-                            exit(-1);
-                        }
-                        
-                    // Error with fork.
-                    } else {
-                        perror("fork");
-                        exit(-1);
-                    }
-                }
+    }
+
+    if (close(src_fd) + close(dest_fd) != 0) {
+        perror("close");
+        return -1;
+    }
+
+    return method == -1 ? -1 : 0;
+}
+
+
+/* Copy src_fd to dest_fd from offset on, JOURNAL_CHUNK bytes at a time,
+ * recording a checkpoint in the journal after each piece. The first offset
+ * bytes of dest_fd already match. flags are as for copy_data.
+ * Return the COPY_* method used, or -1 on error.
+ */
+static int copy_chunks(int src_fd, int dest_fd, const char *dest,
+                       const struct stat *src_st, off_t offset, int flags) {
+    off_t size = src_st->st_size;
+    int method = COPY_CLONE;
+
+    if (offset == 0 && clone_data(src_fd, dest_fd) == 0) {
+        return COPY_CLONE;
+    }
+
+    while (offset < size) {
+        off_t end = size - offset > JOURNAL_CHUNK ? offset + JOURNAL_CHUNK : size;
+
+        method = copy_part(src_fd, dest_fd, offset, end, flags);
+        if (method == -1) {
+            return -1;
+        }
+        offset = end;
+
+        // The checkpoint must not vouch for data still only in memory.
+        if (offset < size) {
+            if (fdatasync(dest_fd) == -1) {
+                perror("fdatasync");
+                return -1;
             }
+            journal_add(dest, src_st, offset, src_fd);
         }
-    
-    // Case 3: if src is a soft link.
-    } else if (S_ISLNK(src_st.st_mode)) {
-        // Skip the link, and do nothing.
     }
-    
-    return error_flag * process_num;
+
+    // A file left from an earlier run may be longer than the source.
+    if (ftruncate(dest_fd, size) == -1) {
+        perror("ftruncate");
+        return -1;
+    }
+    return method;
+}
+
+
+/* Make entry->dest share the data of entry->link, which already holds the
+ * same contents: a reflink if the filesystem supports one, otherwise a hard
+ * link if that gives dest the right mode and times. Return 0 on success, or
+ * -1 if dest has to be copied instead.
+ */
+static int link_file(const struct plan_entry *entry) {
+    int src_fd, dest_fd, cloned;
+    long long start = stats_now();
+
+    if (unlink(entry->dest) == -1 && errno != ENOENT) {
+        perror("unlink");
+        return -1;
+    }
+
+    src_fd = open(entry->link, O_RDONLY);
+    if (src_fd == -1) {
+        perror("open");
+        return -1;
+    }
+    dest_fd = open(entry->dest, O_WRONLY | O_CREAT | O_TRUNC,
+                   entry->st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO));
+    if (dest_fd == -1) {
+        perror("open");
+        close(src_fd);
+        return -1;
+    }
+
+    cloned = clone_data(src_fd, dest_fd) == 0 &&
+             set_times(dest_fd, NULL, &entry->st) == 0;
+    close(src_fd);
+    close(dest_fd);
+
+    if (cloned) {
+        if (copy_opts.verbose) {
+            printf("%s: reflink to %s\n", entry->src, entry->link);
+        }
+        stats_add_time(STATS_META, start);
+        return 0;
+    }
+
+    // No reflinks here, so the only way to share is a hard link.
+    if (!entry->link_hard) {
+        return -1;
+    }
+    if (unlink(entry->dest) == -1 || link(entry->link, entry->dest) == -1) {
+        perror("link");
+        return -1;
+    }
+    if (copy_opts.verbose) {
+        printf("%s: hard link to %s\n", entry->src, entry->link);
+    }
+    stats_add_time(STATS_META, start);
+    return 0;
+}
+
+
+/* If entry->dest has other hard links, remove this name so that the file is
+ * written afresh, and plan to create it instead. An atomic copy keeps the
+ * name until its copy is renamed over it, which breaks the link, so it is
+ * only planned to be overwritten. Return 0 on success, or -1 on error.
+ */
+static int unshare_dest(struct plan_entry *entry) {
+    struct stat st;
+    long long start = stats_now();
+
+    if (lstat(entry->dest, &st) == -1) {
+        perror("lstat");
+        return -1;
+    }
+    stats_add_time(STATS_STAT, start);
+    // Unlinking first would leave nothing at dest until the rename, which
+    // is what an atomic copy must not do.
+    if (st.st_nlink > 1 && copy_opts.atomic) {
+        entry->action = PLAN_OVERWRITE;
+    } else if (st.st_nlink > 1) {
+        if (unlink(entry->dest) == -1) {
+            perror("unlink");
+            return -1;
+        }
+        entry->action = PLAN_CREATE;
+    }
+    return 0;
+}
+
+
+/* Bring the existing file dest up to date with src by rewriting only the
+ * blocks that differ. Return the number of bytes written, or -1 on error.
+ */
+off_t delta_file(const char *src, const char *dest, const struct stat *src_st) {
+    int src_fd, dest_fd;
+    off_t written;
+
+    src_fd = open(src, O_RDONLY);
+    if (src_fd == -1) {
+        perror("open");
+        return -1;
+    }
+
+    dest_fd = open(dest, O_RDWR);
+    if (dest_fd == -1) {
+        perror("open");
+        close(src_fd);
+        return -1;
+    }
+
+    long long start = stats_now();
+    written = delta_data(src_fd, dest_fd, src_st->st_size);
+    stats_add_time(STATS_COPY, start);
+    if (written == -1) {
+        fprintf(stderr, "Error updating %s from %s\n", dest, src);
+    } else {
+        // Both files are read in full, but only the changes are written.
+        stats_add_bytes(2 * (long long)src_st->st_size, written);
+        if (copy_opts.verbose) {
+            printf("%s: %s, %lld bytes rewritten\n", src,
+                   copy_method_name(COPY_DELTA), (long long)written);
+        }
+        if (set_times(dest_fd, NULL, src_st) == -1) {
+            written = -1;
+        } else {
+            journal_add(dest, src_st, src_st->st_size, src_fd);
+        }
+    }
+
+    if (close(src_fd) + close(dest_fd) != 0) {
+        perror("close");
+        return -1;
+    }
+
+    return written;
 }
 
 
@@ -271,25 +779,6 @@ char *get_basename(const char *fname) {
     char *basec, *bname;
     basec = strdup(fname);
     bname = basename(basec);
-    
-    return bname;
-}
 
-
-/* Check two Hashes. Return the first index where two Hashes do not match,
- * or return the block_size if every value matches.
- */
-int check_hash(char *hash1, char *hash2, int block_size) {
-    int result = 0;
-    
-    for(int i = 0; i < block_size; i++) {
-        // Hash value are different;
-        if (hash1[i] != hash2[i]) {
-            result += 1;
-            return result;
-        }
-    }
-    
-    // Hash value are same.
-    return result;
+    return bname;
 }
@@ -1,9 +1,54 @@
 #ifndef _FTREE_H_
 #define _FTREE_H_
 
+/* Options that change how copy_ftree behaves. fcopy fills these in from the
+ * command line before starting the copy.
+ */
+struct copy_options {
+    int verbose;        // Print the copy method used for each file.
+    int jobs;           // Worker threads copying files, or 0 for one per CPU.
+    int delta;          // Update existing files in place, block by block.
+    int checksum;       // Compare contents, not size and mtime, to find
+                        // files that are up to date.
+    int punch;          // Turn long runs of zeros into holes.
+    int nocache;        // Keep big files out of the page cache.
+    long long nocache_size; // Smallest file size that nocache applies to.
+    int direct;         // Use O_DIRECT for nocache instead of dropping pages.
+    int dry_run;        // Print the plan instead of carrying it out.
+    int progress;       // Show progress on stderr while copying.
+    int dedup;          // Copy identical files once and link the rest.
+    int atomic;         // Copy to a temporary name and rename into place.
+    const char *journal; // Journal to resume from and record progress in,
+                        // or NULL for none.
+    long long sync_size; // With atomic, sync and rename after this many
+                        // bytes, or only at the end if 0.
+    const char *report; // File to write a JSON report to, "-" for stdout,
+                        // or NULL for none.
+};
+
+/* What copy_ftree did. Filled in as the copy runs.
+ */
+struct copy_summary {
+    int files_copied;   // Regular files created or overwritten.
+    int files_skipped;  // Regular files that were already up to date.
+    int files_chmod;    // Regular files that only needed their mode set.
+    int files_linked;   // Regular files linked to an identical copy.
+    long long bytes_saved; // Bytes that linking saved copying.
+    int files_done;     // Regular files handled so far, out of
+    int files_total;    // the number in the plan.
+    long long bytes_done;  // Bytes of files copied or compared so far, out
+    long long bytes_total; // of the plan total.
+    int dirs;           // Directories created or updated.
+    int errors;         // Entries that could not be copied.
+    int workers;        // Threads involved in the copy.
+};
+
+extern struct copy_options copy_opts;
+extern struct copy_summary copy_summary;
+
 /* Function for copying a file tree rooted at src to dest
  * Returns < 0 on error. The magnitude of the return value
- * is the number of processes involved in the copy and is
+ * is the number of threads involved in the copy and is
  * at least 1.
  */
 int copy_ftree(const char *src, const char *dest);
@@ -1,7 +1,18 @@
 #ifndef _HASH_H_
 #define _HASH_H_
 
+#include <stddef.h>
+
+// Starting value for hash_buf.
+#define HASH_INIT 14695981039346656037ULL
+
 // Hash manipulation helper functions
 char *hash(FILE *f);
+int hash_fd(int fd, unsigned long long *hash_val);
+
+/* Continue the 64-bit FNV-1a hash h, eight bytes at a time, over the len
+ * bytes at buf, and return the result. Start from HASH_INIT.
+ */
+unsigned long long hash_buf(const char *buf, size_t len, unsigned long long h);
 
 #endif // _HASH_H_
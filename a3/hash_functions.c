@@ -1,8 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "hash.h"
 
 #define BLOCK_SIZE 8
+#define HASH_BUFSIZE (1 << 20)
 
 /* Return the hash value hash_val of FILE *f. */
 char *hash(FILE *f) {
@@ -26,3 +29,48 @@ char *hash(FILE *f) {
     rewind(f);
     return hash_val;
 }
+
+
+unsigned long long hash_buf(const char *buf, size_t len, unsigned long long h) {
+    unsigned long long word;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&word, buf + i, 8);
+        h = (h ^ word) * 1099511628211ULL;
+    }
+    for (; i < len; i++) {
+        h = (h ^ (unsigned char)buf[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+
+/* Compute a 64-bit FNV-1a hash of the contents of the file open at fd, eight
+ * bytes at a time, and save it at hash_val. Return 0 on success, or -1 on
+ * error.
+ */
+int hash_fd(int fd, unsigned long long *hash_val) {
+    unsigned long long h = HASH_INIT;
+    char *buf = malloc(HASH_BUFSIZE);
+    off_t offset = 0;
+    ssize_t num_read;
+    
+    if (buf == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    
+    while ((num_read = pread(fd, buf, HASH_BUFSIZE, offset)) > 0) {
+        h = hash_buf(buf, num_read, h);
+        offset += num_read;
+    }
+    
+    free(buf);
+    if (num_read < 0) {
+        perror("pread");
+        return -1;
+    }
+    *hash_val = h;
+    return 0;
+}
@@ -0,0 +1,360 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "hash.h"
+#include "journal.h"
+
+// Records are collected here and written together once this much is waiting.
+#define JOURNAL_BUFSIZE (64 * 1024)
+
+// Starting number of slots in the table of loaded records.
+#define TABLE_INITIAL 1024
+
+// What the journal says about one destination file. Each line of the journal
+// holds one record:
+//     size mtime_sec mtime_nsec mode offset hash path
+// A later record for the same path replaces an earlier one.
+struct record {
+    char *path;             // NULL for an empty slot.
+    long long size;
+    long long mtime_sec;
+    long mtime_nsec;
+    unsigned mode;
+    long long offset;       // Bytes copied; equal to size once done.
+    unsigned long long hash; // Of the JOURNAL_SAMPLE bytes before offset, or
+                             // 0 if not taken.
+};
+
+// Records loaded from the journal, in an open addressing hash table keyed by
+// path. Only changed while the journal is opened.
+static struct record *table;
+static size_t table_size;
+static size_t table_used;
+
+// Records of finished files waiting to be appended, and an open file on the
+// destination filesystem to sync before they are. Protected by lock.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static char buffer[JOURNAL_BUFSIZE];
+static size_t buffered;
+static int sync_fd = -1;
+
+static int journal_fd = -1;
+static char *journal_path;
+
+
+/* Return the slot in table for path: either its record or an empty slot.
+ */
+static struct record *lookup(const char *path) {
+    size_t i = hash_buf(path, strlen(path), HASH_INIT) & (table_size - 1);
+
+    while (table[i].path != NULL && strcmp(table[i].path, path) != 0) {
+        i = (i + 1) & (table_size - 1);
+    }
+    return &table[i];
+}
+
+
+/* Put rec in the table, replacing any record for the same path. The table
+ * takes over rec->path.
+ */
+static void insert(struct record *rec) {
+    // Keep the table at most half full, so lookups stay short.
+    if (2 * (table_used + 1) > table_size) {
+        struct record *old = table;
+        size_t old_size = table_size;
+
+        table_size = table_size ? table_size * 2 : TABLE_INITIAL;
+        table = calloc(table_size, sizeof(struct record));
+        if (table == NULL) {
+            perror("calloc");
+            exit(-1);
+        }
+        for (size_t i = 0; i < old_size; i++) {
+            if (old[i].path != NULL) {
+                *lookup(old[i].path) = old[i];
+            }
+        }
+        free(old);
+    }
+
+    struct record *slot = lookup(rec->path);
+    if (slot->path == NULL) {
+        table_used++;
+    } else {
+        free(slot->path);
+    }
+    *slot = *rec;
+}
+
+
+/* Read every record in the journal at path into the table. A torn last line,
+ * from a run that was killed mid-write, is ignored.
+ */
+static int load(const char *path) {
+    FILE *fp = fopen(path, "r");
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+
+    if (fp == NULL) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        perror("fopen");
+        return -1;
+    }
+
+    while ((len = getline(&line, &cap, fp)) > 0) {
+        struct record rec;
+        int start = 0;
+
+        if (line[len - 1] != '\n') {
+            break;
+        }
+        line[len - 1] = '\0';
+        if (sscanf(line, "%lld %lld %ld %o %lld %llx %n", &rec.size,
+                   &rec.mtime_sec, &rec.mtime_nsec, &rec.mode, &rec.offset,
+                   &rec.hash, &start) < 6 || start == 0) {
+            continue;
+        }
+        rec.path = strdup(line + start);
+        if (rec.path == NULL) {
+            perror("strdup");
+            exit(-1);
+        }
+        insert(&rec);
+    }
+
+    free(line);
+    fclose(fp);
+    return 0;
+}
+
+
+int journal_open(const char *path, int read_only) {
+    if (load(path) == -1) {
+        return -1;
+    }
+
+    // A dry run only reads the journal, and leaves no file behind.
+    if (read_only) {
+        return 0;
+    }
+
+    journal_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (journal_fd == -1) {
+        perror("open");
+        return -1;
+    }
+    journal_path = strdup(path);
+    return 0;
+}
+
+
+/* Append the len bytes of records at buf to the journal. The journal is
+ * opened with O_APPEND, so records from different threads don't mix.
+ */
+static void write_records(const char *buf, size_t len) {
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = write(journal_fd, buf + done, len - done);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            break;
+        }
+        done += n;
+    }
+}
+
+
+/* Sync the destination filesystem through fd, then append the len bytes of
+ * records of finished files at buf to the journal. A record must not vouch
+ * for data that a crash could still lose, so if there is no fd to sync
+ * through or the sync fails, the records are dropped, and those files are
+ * copied again by the next run. lock must not be held, so other threads can
+ * go on while the sync runs.
+ */
+static void flush_records(const char *buf, size_t len, int fd) {
+    if (fd == -1) {
+        fprintf(stderr, "Error syncing for the journal: records dropped\n");
+        return;
+    }
+    if (syncfs(fd) == -1) {
+        perror("syncfs");
+        return;
+    }
+    write_records(buf, len);
+}
+
+
+void journal_close(int complete) {
+    // Nothing else is adding records by now. A complete copy's journal is
+    // removed anyway.
+    if (journal_fd != -1) {
+        if (!complete && buffered > 0) {
+            flush_records(buffer, buffered, sync_fd);
+        }
+        buffered = 0;
+        if (sync_fd != -1) {
+            close(sync_fd);
+            sync_fd = -1;
+        }
+        close(journal_fd);
+        journal_fd = -1;
+
+        if (complete && unlink(journal_path) == -1) {
+            perror("unlink");
+        }
+        free(journal_path);
+        journal_path = NULL;
+    }
+
+    for (size_t i = 0; i < table_size; i++) {
+        free(table[i].path);
+    }
+    free(table);
+    table = NULL;
+    table_size = table_used = 0;
+}
+
+
+/* Return the loaded record for dest if it was made from a source that still
+ * matches src_st, or NULL.
+ */
+static const struct record *find(const char *dest, const struct stat *src_st) {
+    if (table == NULL) {
+        return NULL;
+    }
+
+    const struct record *rec = lookup(dest);
+    if (rec->path == NULL || rec->size != src_st->st_size ||
+        rec->mtime_sec != src_st->st_mtim.tv_sec ||
+        rec->mtime_nsec != src_st->st_mtim.tv_nsec ||
+        rec->mode != (src_st->st_mode & (S_IRWXU | S_IRWXG | S_IRWXO))) {
+        return NULL;
+    }
+    return rec;
+}
+
+
+int journal_done(const char *dest, const struct stat *src_st) {
+    const struct record *rec = find(dest, src_st);
+
+    return rec != NULL && rec->offset == rec->size;
+}
+
+
+/* Hash the JOURNAL_SAMPLE bytes of fd before offset into *hash_val.
+ * Return 0 on success, or -1 if they can't all be read.
+ */
+static int hash_sample(int fd, off_t offset, unsigned long long *hash_val) {
+    char buf[JOURNAL_SAMPLE];
+    off_t start = offset > JOURNAL_SAMPLE ? offset - JOURNAL_SAMPLE : 0;
+    size_t len = offset - start;
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, start + done);
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    *hash_val = hash_buf(buf, len, HASH_INIT);
+    return 0;
+}
+
+
+off_t journal_resume(const char *dest, const struct stat *src_st,
+                     int dest_fd) {
+    const struct record *rec = find(dest, src_st);
+    unsigned long long hash_val;
+    struct stat dest_st;
+
+    if (rec == NULL || rec->offset == 0 || rec->offset >= rec->size ||
+        rec->hash == 0) {
+        return 0;
+    }
+
+    // The checkpoint only counts if dest still holds the data it covered.
+    if (fstat(dest_fd, &dest_st) == -1 || dest_st.st_size < rec->offset ||
+        hash_sample(dest_fd, rec->offset, &hash_val) == -1 ||
+        hash_val != rec->hash) {
+        return 0;
+    }
+    return rec->offset;
+}
+
+
+void journal_add(const char *dest, const struct stat *src_st, off_t offset,
+                 int src_fd) {
+    unsigned long long hash_val = 0;
+    char line[PATH_MAX + 128];
+    int len;
+
+    // A newline in the path would break the line format.
+    if (journal_fd == -1 || strchr(dest, '\n') != NULL) {
+        return;
+    }
+    if (src_fd != -1 && offset > 0 &&
+        hash_sample(src_fd, offset, &hash_val) == -1) {
+        hash_val = 0;
+    }
+
+    len = snprintf(line, sizeof(line), "%lld %lld %ld %o %lld %llx %s\n",
+                   (long long)src_st->st_size,
+                   (long long)src_st->st_mtim.tv_sec, src_st->st_mtim.tv_nsec,
+                   src_st->st_mode & (S_IRWXU | S_IRWXG | S_IRWXO),
+                   (long long)offset, hash_val, dest);
+    if (len >= (int)sizeof(line)) {
+        return;
+    }
+
+    // A checkpoint is only any use if it outlives the process, so it is
+    // written at once. Its caller has synced the data it covers.
+    if (offset < src_st->st_size) {
+        write_records(line, len);
+        return;
+    }
+
+    // Records of finished files are written together, after one sync of
+    // the filesystem for all of them.
+    char *full = NULL;
+    size_t full_len = 0;
+    int fd;
+
+    pthread_mutex_lock(&lock);
+    if (sync_fd == -1 && (sync_fd = open(dest, O_RDONLY)) == -1) {
+        perror("open");
+    }
+    fd = sync_fd;
+    if (buffered + len > JOURNAL_BUFSIZE) {
+        full = malloc(buffered);
+        if (full == NULL) {
+            perror("malloc");
+            exit(-1);
+        }
+        memcpy(full, buffer, buffered);
+        full_len = buffered;
+        buffered = 0;
+    }
+    memcpy(buffer + buffered, line, len);
+    buffered += len;
+    pthread_mutex_unlock(&lock);
+
+    if (full != NULL) {
+        flush_records(full, full_len, fd);
+        free(full);
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Files at least this big are copied in JOURNAL_CHUNK pieces, with a
+// checkpoint in the journal after each one.
+#define JOURNAL_LARGE (64 << 20)
+#define JOURNAL_CHUNK (16 << 20)
+
+// Bytes before an offset that are hashed to check the data up to it.
+#define JOURNAL_SAMPLE (64 * 1024)
+
+/* Load the records of an earlier, unfinished run from the journal at path, if
+ * there is one, and open it to append new records, creating it if needed.
+ * If read_only is set, as for a dry run, nothing is created or recorded.
+ * Return 0 on success, or -1 on error.
+ */
+int journal_open(const char *path, int read_only);
+
+/* Write out any buffered records and close the journal. If the copy is
+ * complete, the journal is removed, since nothing is left to resume.
+ */
+void journal_close(int complete);
+
+/* Return 1 if the journal says dest was brought up to date with a source
+ * that still has the size, mtime and mode in src_st, or 0 otherwise.
+ */
+int journal_done(const char *dest, const struct stat *src_st);
+
+/* Return how much of dest a previous run had copied from a source that still
+ * matches src_st, or 0 if it is not known. dest_fd is dest open for reading;
+ * the data before the offset is checked against the recorded hash.
+ */
+off_t journal_resume(const char *dest, const struct stat *src_st,
+                     int dest_fd);
+
+/* Record that the first offset bytes of the source described by src_st have
+ * been copied to dest, all of it if offset is st_size. If src_fd is not -1,
+ * the last JOURNAL_SAMPLE bytes before offset are read from it and hashed
+ * into the record. A partial record is written out at once, and the caller
+ * must have synced those bytes of dest first. Others are buffered, and
+ * written once the destination filesystem has been synced. Safe to call
+ * from any thread.
+ */
+void journal_add(const char *dest, const struct stat *src_st, off_t offset,
+                 int src_fd);
+
+#endif // _JOURNAL_H_
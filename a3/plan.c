@@ -0,0 +1,355 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "ftree.h"
+#include "plan.h"
+#include "journal.h"
+
+// Starting size of the plan's entry arrays.
+#define PLAN_INITIAL 64
+
+
+/* Append an entry to the array *list, growing it if needed, and count it in
+ * plan. The paths are copied.
+ */
+static void add_entry(struct plan *plan, struct plan_entry **list, int *num,
+                      int *max, const char *src, const char *dest,
+                      const struct stat *st, int action) {
+    if (*num == *max) {
+        *max = *max ? *max * 2 : PLAN_INITIAL;
+        *list = realloc(*list, *max * sizeof(struct plan_entry));
+        if (*list == NULL) {
+            perror("realloc");
+            exit(-1);
+        }
+    }
+
+    struct plan_entry *entry = &(*list)[(*num)++];
+    entry->src = strdup(src);
+    entry->dest = strdup(dest);
+    entry->st = *st;
+    entry->action = action;
+    entry->link = NULL;
+    entry->primary = NULL;
+    entry->link_hard = 0;
+    entry->failed = 0;
+    if (entry->src == NULL || entry->dest == NULL) {
+        perror("strdup");
+        exit(-1);
+    }
+
+    plan->count[action]++;
+    if (S_ISREG(st->st_mode)) {
+        plan->bytes[action] += st->st_size;
+    }
+}
+
+
+int same_mtime(const struct stat *st1, const struct stat *st2) {
+    return st1->st_mtim.tv_sec == st2->st_mtim.tv_sec &&
+           st1->st_mtim.tv_nsec == st2->st_mtim.tv_nsec;
+}
+
+
+/* Return 1 if st1 and st2 have the same permission bits, or 0 otherwise.
+ */
+static int same_mode(const struct stat *st1, const struct stat *st2) {
+    return (st1->st_mode & (S_IRWXU | S_IRWXG | S_IRWXO)) ==
+           (st2->st_mode & (S_IRWXU | S_IRWXG | S_IRWXO));
+}
+
+
+/* Plan the copy of the regular file src to new_path. If dest_missing is set,
+ * the parent of new_path does not exist yet, so neither does new_path.
+ */
+static void plan_file(struct plan *plan, const char *src,
+                      const struct stat *src_st, const char *new_path,
+                      int dest_missing) {
+    struct stat dest_st;
+    int action;
+
+    if (dest_missing) {
+        action = PLAN_CREATE;
+
+    // An earlier run that was cut short already finished this one.
+    } else if (journal_done(new_path, src_st)) {
+        action = PLAN_SKIP;
+
+    } else if (lstat(new_path, &dest_st) == -1) {
+        if (errno != ENOENT) {
+            perror("lstat");
+            plan->errors++;
+            return;
+        }
+        action = PLAN_CREATE;
+
+    // If the file and the directory have the same name, then there is a
+    // mismatch error.
+    } else if (!S_ISREG(dest_st.st_mode)) {
+        action = PLAN_MISMATCH;
+
+    } else if (dest_st.st_size != src_st->st_size) {
+        action = PLAN_OVERWRITE;
+
+    // With -c the contents decide, and they are only read when copying.
+    } else if (copy_opts.checksum) {
+        action = PLAN_COMPARE;
+
+    // Quick check: a file with the same size and modification time is taken
+    // to be up to date.
+    } else if (!same_mtime(&dest_st, src_st)) {
+        action = PLAN_OVERWRITE;
+
+    } else if (!same_mode(&dest_st, src_st)) {
+        action = PLAN_CHMOD;
+
+    } else {
+        action = PLAN_SKIP;
+    }
+
+    add_entry(plan, &plan->files, &plan->num_files, &plan->max_files,
+              src, new_path, src_st, action);
+}
+
+
+/* Plan the copy of the directory src to new_path, then of everything in it.
+ * If dest_missing is set, the parent of new_path does not exist yet.
+ */
+static void plan_dir(struct plan *plan, const char *src,
+                     const struct stat *src_st, const char *new_path,
+                     int dest_missing) {
+    DIR *src_ptr;
+    struct dirent *src_element;
+    char src_element_path[PATH_MAX];
+    char dest_element_path[PATH_MAX];
+    struct stat st;
+    int action = PLAN_CREATE;
+
+    if (!dest_missing) {
+        if (lstat(new_path, &st) == -1) {
+            if (errno != ENOENT) {
+                perror("lstat");
+                plan->errors++;
+                return;
+            }
+            dest_missing = 1;
+
+        // Nothing below a mismatched directory can be copied.
+        } else if (!S_ISDIR(st.st_mode)) {
+            add_entry(plan, &plan->dirs, &plan->num_dirs, &plan->max_dirs,
+                      src, new_path, src_st, PLAN_MISMATCH);
+            return;
+
+        } else {
+            action = same_mode(&st, src_st) ? PLAN_SKIP : PLAN_CHMOD;
+        }
+    }
+
+    add_entry(plan, &plan->dirs, &plan->num_dirs, &plan->max_dirs,
+              src, new_path, src_st, action);
+
+    src_ptr = opendir(src);
+    if (src_ptr == NULL) {
+        perror("opendir");
+        plan->errors++;
+        return;
+    }
+
+    while ((src_element = readdir(src_ptr)) != NULL) {
+        // No filename that starts with '.' should be included.
+        if (src_element->d_name[0] == '.') {
+            continue;
+        }
+
+        // Get the path of element in src and where it should go in dest.
+        if (snprintf(src_element_path, PATH_MAX, "%s/%s", src,
+                     src_element->d_name) >= PATH_MAX ||
+            snprintf(dest_element_path, PATH_MAX, "%s/%s", new_path,
+                     src_element->d_name) >= PATH_MAX) {
+            fprintf(stderr, "Path too long: %s/%s\n", src, src_element->d_name);
+            plan->errors++;
+            continue;
+        }
+
+        if (lstat(src_element_path, &st) == -1) {
+            perror("lstat");
+            plan->errors++;
+            continue;
+        }
+
+        if (S_ISREG(st.st_mode)) {
+            plan_file(plan, src_element_path, &st, dest_element_path,
+                      dest_missing);
+        } else if (S_ISDIR(st.st_mode)) {
+            plan_dir(plan, src_element_path, &st, dest_element_path,
+                     dest_missing);
+        }
+        // Soft links are skipped.
+    }
+
+    closedir(src_ptr);
+}
+
+
+/* Plan the copy of src to new_path. If dest_missing is set, nothing at
+ * new_path is looked at.
+ */
+static void build(struct plan *plan, const char *src, const char *new_path,
+                  int dest_missing) {
+    struct stat src_st;
+
+    if (lstat(src, &src_st) == -1) {
+        perror("lstat");
+        plan->errors++;
+        return;
+    }
+
+    if (S_ISREG(src_st.st_mode)) {
+        plan_file(plan, src, &src_st, new_path, dest_missing);
+    } else if (S_ISDIR(src_st.st_mode)) {
+        plan_dir(plan, src, &src_st, new_path, dest_missing);
+    }
+}
+
+
+void plan_build(struct plan *plan, const char *src, const char *new_path) {
+    build(plan, src, new_path, 0);
+}
+
+
+void plan_build_new(struct plan *plan, const char *src, const char *new_path) {
+    build(plan, src, new_path, 1);
+}
+
+
+/* Order plan entries by device, then by inode number. Filesystems place
+ * inodes, and usually their data, in allocation order, so this reads the
+ * source roughly front to back. Links sort after everything else.
+ */
+static int compare_locality(const void *a, const void *b) {
+    const struct stat *st1 = &((const struct plan_entry *)a)->st;
+    const struct stat *st2 = &((const struct plan_entry *)b)->st;
+    int link1 = ((const struct plan_entry *)a)->action == PLAN_LINK;
+    int link2 = ((const struct plan_entry *)b)->action == PLAN_LINK;
+
+    if (link1 != link2) {
+        return link1 - link2;
+    }
+
+    if (st1->st_dev != st2->st_dev) {
+        return st1->st_dev < st2->st_dev ? -1 : 1;
+    }
+    if (st1->st_ino != st2->st_ino) {
+        return st1->st_ino < st2->st_ino ? -1 : 1;
+    }
+    return 0;
+}
+
+
+/* Order pointers to plan entries by destination path.
+ */
+static int compare_dest(const void *a, const void *b) {
+    return strcmp((*(struct plan_entry *const *)a)->dest,
+                  (*(struct plan_entry *const *)b)->dest);
+}
+
+
+void plan_sort(struct plan *plan) {
+    int copies = plan->num_files - plan->count[PLAN_LINK];
+
+    qsort(plan->files, plan->num_files, sizeof(struct plan_entry),
+          compare_locality);
+    if (plan->count[PLAN_LINK] == 0) {
+        return;
+    }
+
+    // Find the entry each link points at by its path, which is unique.
+    struct plan_entry **by_dest = malloc(copies * sizeof(struct plan_entry *));
+    if (by_dest == NULL) {
+        perror("malloc");
+        exit(-1);
+    }
+    for (int i = 0; i < copies; i++) {
+        by_dest[i] = &plan->files[i];
+    }
+    qsort(by_dest, copies, sizeof(struct plan_entry *), compare_dest);
+
+    for (int i = copies; i < plan->num_files; i++) {
+        struct plan_entry key = {.dest = plan->files[i].link};
+        struct plan_entry *key_ptr = &key;
+        struct plan_entry **found = bsearch(&key_ptr, by_dest, copies,
+                                            sizeof(struct plan_entry *),
+                                            compare_dest);
+        plan->files[i].primary = found ? *found : NULL;
+    }
+    free(by_dest);
+}
+
+
+void plan_print(const struct plan *plan) {
+    for (int i = 0; i < plan->num_dirs; i++) {
+        printf("%-9s %12s  %s/\n", plan_action_name(plan->dirs[i].action), "-",
+               plan->dirs[i].dest);
+    }
+    for (int i = 0; i < plan->num_files; i++) {
+        const struct plan_entry *entry = &plan->files[i];
+        printf("%-9s %12lld  %s", plan_action_name(entry->action),
+               (long long)entry->st.st_size, entry->dest);
+        if (entry->action == PLAN_LINK) {
+            printf(" => %s", entry->link);
+        }
+        printf("\n");
+    }
+
+    printf("Plan: %d to create, %d to overwrite, %d to compare, "
+           "%d chmod only, %d up to date, %d mismatched, %d to link, "
+           "%d errors\n",
+           plan->count[PLAN_CREATE], plan->count[PLAN_OVERWRITE],
+           plan->count[PLAN_COMPARE], plan->count[PLAN_CHMOD],
+           plan->count[PLAN_SKIP], plan->count[PLAN_MISMATCH],
+           plan->count[PLAN_LINK], plan->errors);
+    printf("%lld bytes to copy, %lld bytes to compare, %lld bytes to link\n",
+           plan->bytes[PLAN_CREATE] + plan->bytes[PLAN_OVERWRITE],
+           plan->bytes[PLAN_COMPARE], plan->bytes[PLAN_LINK]);
+}
+
+
+void plan_free(struct plan *plan) {
+    for (int i = 0; i < plan->num_dirs; i++) {
+        free(plan->dirs[i].src);
+        free(plan->dirs[i].dest);
+    }
+    for (int i = 0; i < plan->num_files; i++) {
+        free(plan->files[i].src);
+        free(plan->files[i].dest);
+    }
+    free(plan->dirs);
+    free(plan->files);
+}
+
+
+const char *plan_action_name(int action) {
+    switch (action) {
+        case PLAN_CREATE:
+            return "create";
+        case PLAN_OVERWRITE:
+            return "overwrite";
+        case PLAN_COMPARE:
+            return "compare";
+        case PLAN_CHMOD:
+            return "chmod";
+        case PLAN_SKIP:
+            return "skip";
+        case PLAN_MISMATCH:
+            return "mismatch";
+        case PLAN_LINK:
+            return "link";
+        default:
+            return "unknown";
+    }
+}
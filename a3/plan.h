@@ -0,0 +1,73 @@
+#ifndef _PLAN_H_
+#define _PLAN_H_
+
+#include <sys/stat.h>
+
+// What copy_ftree will do with an entry.
+#define PLAN_CREATE 0       // The destination is missing.
+#define PLAN_OVERWRITE 1    // The destination differs from the source.
+#define PLAN_COMPARE 2      // Same size; contents are compared when copying.
+#define PLAN_CHMOD 3        // Only the permissions differ.
+#define PLAN_SKIP 4         // The destination is up to date.
+#define PLAN_MISMATCH 5     // A file on one side is a directory on the other.
+#define PLAN_LINK 6         // Same contents as another file being copied.
+#define PLAN_ACTIONS 7
+
+// One file or directory to bring up to date.
+struct plan_entry {
+    char *src;              // Path of the source.
+    char *dest;             // Path it is copied to.
+    struct stat st;         // lstat of src.
+    int action;             // One of PLAN_*.
+    char *link;             // For PLAN_LINK, the dest of the identical file,
+    struct plan_entry *primary; // its entry once plan_sort has run,
+    int link_hard;          // and whether a hard link to it would be exact.
+    int failed;             // Set if carrying out the entry failed.
+};
+
+// Everything copy_ftree will do, worked out before anything is changed.
+struct plan {
+    struct plan_entry *dirs;    // Directories, parents before children.
+    int num_dirs;
+    int max_dirs;
+    struct plan_entry *files;   // Regular files.
+    int num_files;
+    int max_files;
+    int errors;                 // Entries that could not be planned.
+    int count[PLAN_ACTIONS];    // Entries planned for each action.
+    long long bytes[PLAN_ACTIONS]; // Bytes of the files for each action.
+};
+
+/* Walk src, which is copied to new_path, and the matching part of the
+ * destination, and fill in plan with what needs to be done. Nothing is
+ * changed on disk. plan must be zeroed first. Errors found while walking are
+ * printed and counted in plan->errors.
+ */
+void plan_build(struct plan *plan, const char *src, const char *new_path);
+
+/* Like plan_build, but plan every entry as PLAN_CREATE without looking at
+ * the destination, for copies to somewhere other than a directory tree.
+ */
+void plan_build_new(struct plan *plan, const char *src, const char *new_path);
+
+/* Put the files of plan in the order that reads the source with the least
+ * seeking, except that PLAN_LINK files go last, after the files they link
+ * to, and point each of those at the entry it links to.
+ */
+void plan_sort(struct plan *plan);
+
+/* Print every entry of plan, then the totals.
+ */
+void plan_print(const struct plan *plan);
+
+/* Free the memory held by plan.
+ */
+void plan_free(struct plan *plan);
+
+/* Return a printable name for a PLAN_* action. */
+const char *plan_action_name(int action);
+
+/* Return 1 if st1 and st2 have the same modification time, or 0 otherwise. */
+int same_mtime(const struct stat *st1, const struct stat *st2);
+
+#endif // _PLAN_H_
@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "pool.h"
+
+
+// The work queue is the array being run, and next is its first unclaimed
+// item. Both are protected by lock.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static char *queue;
+static size_t item_size;
+static int num_items;
+static int next;
+static item_fn run_item;
+
+
+/* Claim items from the queue and run them until none are left.
+ */
+static void *worker(void *arg) {
+    while (1) {
+        pthread_mutex_lock(&lock);
+        if (next == num_items) {
+            pthread_mutex_unlock(&lock);
+            return NULL;
+        }
+        void *item = queue + (size_t)next++ * item_size;
+        pthread_mutex_unlock(&lock);
+
+        run_item(item);
+    }
+}
+
+
+int pool_run(void *items, size_t size, int count, int workers, item_fn fn) {
+    pthread_t threads[POOL_MAX_WORKERS];
+    int num_threads;
+
+    if (workers < 1) {
+        workers = 1;
+    } else if (workers > POOL_MAX_WORKERS) {
+        workers = POOL_MAX_WORKERS;
+    }
+
+    queue = items;
+    item_size = size;
+    num_items = count;
+    next = 0;
+    run_item = fn;
+
+    for (num_threads = 0; num_threads < workers; num_threads++) {
+        if (pthread_create(&threads[num_threads], NULL, worker, NULL) != 0) {
+            perror("pthread_create");
+            break;
+        }
+    }
+    if (num_threads == 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return num_threads;
+}
@@ -0,0 +1,19 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stddef.h>
+
+// Upper bound on the number of worker threads.
+#define POOL_MAX_WORKERS 256
+
+// Function the workers run on each item.
+typedef void (*item_fn)(void *item);
+
+/* Run fn on each of the count items of size bytes in the array items, using
+ * a pool of workers threads. Items are handed out in array order, each to
+ * the next idle worker. Return once every item is done, with the number of
+ * threads used, or -1 if none could be started.
+ */
+int pool_run(void *items, size_t size, int count, int workers, item_fn fn);
+
+#endif // _POOL_H_
@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "ftree.h"
+#include "stats.h"
+
+// A file that took a long time to handle.
+struct slow_file {
+    char *path;
+    long long ns;
+};
+
+// Counters one thread adds to without locking. Each thread's counters are
+// put on a list the first time it uses them, and are merged for the report.
+struct thread_stats {
+    long long phase_ns[STATS_PHASES];
+    long long bytes_read;
+    long long bytes_written;
+    int histogram[STATS_BUCKETS];
+    struct slow_file slowest[STATS_SLOWEST];     // Slowest first.
+    int num_slowest;
+    struct thread_stats *next;
+};
+
+// Protects the list of every thread's counters.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_stats *all_stats;
+
+static __thread struct thread_stats *mine;
+static long long started;
+
+
+/* Return the counters of the calling thread, making them on first use. They
+ * outlive the thread, so the report can still read them.
+ */
+static struct thread_stats *thread_stats(void) {
+    if (mine == NULL) {
+        mine = calloc(1, sizeof(struct thread_stats));
+        if (mine == NULL) {
+            perror("calloc");
+            exit(-1);
+        }
+        pthread_mutex_lock(&lock);
+        mine->next = all_stats;
+        all_stats = mine;
+        pthread_mutex_unlock(&lock);
+    }
+    return mine;
+}
+
+
+long long stats_now(void) {
+    struct timespec now;
+    long long unset = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+
+    // The first call marks the start of the copy.
+    if (__atomic_load_n(&started, __ATOMIC_RELAXED) == 0) {
+        __atomic_compare_exchange_n(&started, &unset, ns, 0, __ATOMIC_RELAXED,
+                                    __ATOMIC_RELAXED);
+    }
+    return ns;
+}
+
+
+void stats_add_time(int phase, long long start) {
+    thread_stats()->phase_ns[phase] += stats_now() - start;
+}
+
+
+void stats_add_bytes(long long read, long long written) {
+    struct thread_stats *t = thread_stats();
+
+    t->bytes_read += read;
+    t->bytes_written += written;
+}
+
+
+/* Add the file at path, which took ns nanoseconds, to the list of the
+ * slowest files, slowest first, if it is slow enough. The path is copied.
+ */
+static void add_slow(struct slow_file *slowest, int *num_slowest,
+                     const char *path, long long ns) {
+    // Insert into the list, dropping the fastest if it is full.
+    if (*num_slowest < STATS_SLOWEST || ns > slowest[*num_slowest - 1].ns) {
+        int i = *num_slowest < STATS_SLOWEST ? (*num_slowest)++ :
+                                               *num_slowest - 1;
+        free(slowest[i].path);
+        for (; i > 0 && slowest[i - 1].ns < ns; i--) {
+            slowest[i] = slowest[i - 1];
+        }
+        slowest[i].path = strdup(path);
+        slowest[i].ns = ns;
+    }
+}
+
+
+void stats_add_file(const char *path, long long ns) {
+    struct thread_stats *t = thread_stats();
+    int bucket = 0;
+
+    // Bucket b holds latencies under 2^b microseconds.
+    for (long long us = ns / 1000; us > 0 && bucket < STATS_BUCKETS - 1;
+         us >>= 1) {
+        bucket++;
+    }
+    t->histogram[bucket]++;
+    add_slow(t->slowest, &t->num_slowest, path, ns);
+}
+
+
+/* Write s to f as a JSON string.
+ */
+static void print_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(f, "\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(f, "\\u%04x", *s);
+        } else {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+
+void stats_report(FILE *f) {
+    static const char *phase_names[STATS_PHASES] = {
+        "stat", "hash", "copy", "meta"
+    };
+    long long elapsed = stats_now() - started;
+    struct thread_stats total = {0};
+    int last = 0;
+
+    // Every other thread has finished with its counters by now.
+    pthread_mutex_lock(&lock);
+    for (struct thread_stats *t = all_stats; t != NULL; t = t->next) {
+        for (int i = 0; i < STATS_PHASES; i++) {
+            total.phase_ns[i] += t->phase_ns[i];
+        }
+        total.bytes_read += t->bytes_read;
+        total.bytes_written += t->bytes_written;
+        for (int i = 0; i < STATS_BUCKETS; i++) {
+            total.histogram[i] += t->histogram[i];
+        }
+        for (int i = 0; i < t->num_slowest; i++) {
+            add_slow(total.slowest, &total.num_slowest,
+                     t->slowest[i].path ? t->slowest[i].path : "",
+                     t->slowest[i].ns);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"files\": {\"copied\": %d, \"skipped\": %d, \"chmod\": %d, "
+            "\"linked\": %d, \"errors\": %d},\n", copy_summary.files_copied,
+            copy_summary.files_skipped, copy_summary.files_chmod,
+            copy_summary.files_linked, copy_summary.errors);
+    fprintf(f, "  \"dirs\": %d,\n", copy_summary.dirs);
+    fprintf(f, "  \"threads\": %d,\n", copy_summary.workers);
+    fprintf(f, "  \"bytes\": {\"read\": %lld, \"written\": %lld, "
+            "\"saved\": %lld},\n", total.bytes_read, total.bytes_written,
+            copy_summary.bytes_saved);
+    fprintf(f, "  \"seconds\": {\"elapsed\": %.6f", elapsed / 1e9);
+    for (int i = 0; i < STATS_PHASES; i++) {
+        fprintf(f, ", \"%s\": %.6f", phase_names[i], total.phase_ns[i] / 1e9);
+    }
+    fprintf(f, "},\n");
+
+    // Bucket b is printed with its upper bound, 2^b microseconds. Empty
+    // buckets past the slowest file are left out.
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        if (total.histogram[i] > 0) {
+            last = i;
+        }
+    }
+    fprintf(f, "  \"latency_us\": [");
+    for (int i = 0; i <= last; i++) {
+        fprintf(f, "%s{\"under\": %lld, \"files\": %d}", i ? ", " : "",
+                1LL << i, total.histogram[i]);
+    }
+    fprintf(f, "],\n");
+
+    fprintf(f, "  \"slowest\": [");
+    for (int i = 0; i < total.num_slowest; i++) {
+        fprintf(f, "%s\n    {\"path\": ", i ? "," : "");
+        print_string(f, total.slowest[i].path ? total.slowest[i].path : "");
+        fprintf(f, ", \"seconds\": %.6f}", total.slowest[i].ns / 1e9);
+    }
+    fprintf(f, "%s]\n}\n", total.num_slowest ? "\n  " : "");
+
+    for (int i = 0; i < total.num_slowest; i++) {
+        free(total.slowest[i].path);
+    }
+}
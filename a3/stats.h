@@ -0,0 +1,43 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdio.h>
+
+// Kinds of work that copy_ftree times.
+#define STATS_STAT 0        // Walking the trees to build the plan.
+#define STATS_HASH 1        // Hashing and comparing file contents.
+#define STATS_COPY 2        // Moving file data.
+#define STATS_META 3        // mkdir, chmod, timestamps and links.
+#define STATS_PHASES 4
+
+// Per-file latencies are counted in buckets of powers of two microseconds.
+#define STATS_BUCKETS 32
+
+// Number of slowest files kept for the report.
+#define STATS_SLOWEST 10
+
+/* Return the current time in nanoseconds, for timing with stats_add_time.
+ */
+long long stats_now(void);
+
+/* Add the time since start, from stats_now, to phase, one of STATS_*.
+ * Times from different threads add up, so the phase totals can be more than
+ * the elapsed time.
+ */
+void stats_add_time(int phase, long long start);
+
+/* Count bytes read from and written to files.
+ */
+void stats_add_bytes(long long read, long long written);
+
+/* Record that the file at path took ns nanoseconds to handle.
+ */
+void stats_add_file(const char *path, long long ns);
+
+/* Write a JSON report of the copy to f: the copy_summary counts, the bytes
+ * moved, the time spent in each phase, the per-file latency histogram and the
+ * slowest files.
+ */
+void stats_report(FILE *f);
+
+#endif // _STATS_H_
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "hash.h"
+#include "delta.h"
+
+// Bytes of a file read at a time to sign it, at least.
+#define SIGN_BUFSIZE (1 << 20)
+
+
+unsigned delta_block_size(long long size) {
+    long long block_size = DELTA_BLOCK_MIN;
+
+    // The power of two at or above the square root of size, within the
+    // limits.
+    while (block_size * block_size < size ||
+           size / block_size > DELTA_BLOCKS_MAX) {
+        block_size *= 2;
+    }
+    return block_size < DELTA_BLOCK_MAX ? block_size : DELTA_BLOCK_MAX;
+}
+
+
+// The weak checksum of rsync: the sum of the bytes of a window in the low 16
+// bits, and the sum of those sums as the window grows in the high 16.
+unsigned weak_sum(const char *buf, size_t len) {
+    unsigned a = 0, b = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        a += (unsigned char)buf[i];
+        b += (len - i) * (unsigned char)buf[i];
+    }
+    return (b & 0xffff) << 16 | (a & 0xffff);
+}
+
+
+unsigned weak_roll(unsigned sum, unsigned char out, unsigned char in,
+                   size_t len) {
+    unsigned a = (sum & 0xffff) - out + in;
+    unsigned b = (sum >> 16) - len * out + a;
+
+    return (b & 0xffff) << 16 | (a & 0xffff);
+}
+
+
+/* Store the low bytes bytes of v at buf, lowest first.
+ */
+static void put_le(unsigned char *buf, unsigned long long v, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        buf[i] = v >> (8 * i);
+    }
+}
+
+
+/* Return the number stored in the bytes bytes at buf, lowest first.
+ */
+static unsigned long long get_le(const unsigned char *buf, int bytes) {
+    unsigned long long v = 0;
+
+    for (int i = bytes - 1; i >= 0; i--) {
+        v = v << 8 | buf[i];
+    }
+    return v;
+}
+
+
+int make_signatures(int fd, long count, unsigned block_size, struct wbuf *b) {
+    // Whole blocks are read at a time, as many as fit in SIGN_BUFSIZE.
+    long per_read = SIGN_BUFSIZE / block_size > 0 ?
+                    SIGN_BUFSIZE / block_size : 1;
+    char *buf = malloc(per_read * block_size);
+
+    if (!buf) {
+        perror("malloc");
+        return -1;
+    }
+    wbuf_reserve(b, count * SIGNATURE_SIZE);
+
+    for (long i = 0; i < count; ) {
+        long blocks = count - i < per_read ? count - i : per_read;
+        size_t want = blocks * block_size, done = 0;
+        off_t offset = (off_t)i * block_size;
+
+        while (done < want) {
+            ssize_t n = pread(fd, buf + done, want - done, offset + done);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                if (n == -1) {
+                    perror("pread");
+                }
+                free(buf);
+                return -1;
+            }
+            done += n;
+        }
+
+        for (long j = 0; j < blocks; j++, i++) {
+            unsigned char *sig = (unsigned char *)b->data + b->len;
+            const char *block = buf + j * block_size;
+            put_le(sig, weak_sum(block, block_size), 4);
+            put_le(sig + 4, hash_buf(block, block_size, HASH_INIT), 8);
+            b->len += SIGNATURE_SIZE;
+        }
+    }
+
+    free(buf);
+    return 0;
+}
+
+
+int sigtable_load(struct sigtable *st, const char *buf, size_t len) {
+    unsigned long long block_size, count;
+    int n, m;
+
+    if ((n = get_varint(buf, len, &block_size)) <= 0 ||
+        (m = get_varint(buf + n, len - n, &count)) <= 0 ||
+        block_size == 0 || block_size > DELTA_BLOCK_MAX ||
+        count > DELTA_BLOCKS_MAX || len - n - m != count * SIGNATURE_SIZE) {
+        return -1;
+    }
+    st->block_size = block_size;
+    st->count = count;
+    st->sigs = (const unsigned char *)buf + n + m;
+
+    // Keep the table at most half full.
+    unsigned long size = 1;
+    while (size < 2 * count) {
+        size *= 2;
+    }
+    st->mask = size - 1;
+    st->heads = malloc(size * sizeof(long));
+    st->next = malloc((count ? count : 1) * sizeof(long));
+    if (!st->heads || !st->next) {
+        perror("malloc");
+        exit(1);
+    }
+    memset(st->heads, -1, size * sizeof(long));
+
+    // Later blocks go in first, so each bucket lists its blocks in order.
+    for (long i = count - 1; i >= 0; i--) {
+        unsigned long bucket = get_le(st->sigs + i * SIGNATURE_SIZE, 4) &
+                               st->mask;
+        st->next[i] = st->heads[bucket];
+        st->heads[bucket] = i;
+    }
+    return 0;
+}
+
+
+long sigtable_find(const struct sigtable *st, unsigned weak,
+                   const char *block, long hint) {
+    unsigned long long strong = 0;
+    int hashed = 0;
+    long i = hint >= 0 && hint < st->count ? hint : st->heads[weak & st->mask];
+
+    // The hint first, then the bucket. The strong hash is only worked out if
+    // a weak checksum matches.
+    while (i != -1) {
+        const unsigned char *sig = st->sigs + i * SIGNATURE_SIZE;
+        if (get_le(sig, 4) == weak) {
+            if (!hashed) {
+                strong = hash_buf(block, st->block_size, HASH_INIT);
+                hashed = 1;
+            }
+            if (get_le(sig + 4, 8) == strong) {
+                return i;
+            }
+        }
+        if (i == hint) {
+            hint = -1;
+            i = st->heads[weak & st->mask];
+        } else {
+            i = st->next[i];
+        }
+    }
+    return -1;
+}
+
+
+void sigtable_free(struct sigtable *st) {
+    free(st->heads);
+    free(st->next);
+    st->heads = st->next = NULL;
+}
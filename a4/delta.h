@@ -0,0 +1,87 @@
+#ifndef _DELTA_H_
+#define _DELTA_H_
+
+#include "wire.h"
+
+// With FEATURE_DELTA, a file the server has an older copy of may be sent as
+// the difference from that copy. The client asks with a DELTAFILE request,
+// which carries an entry as TRANSFILE does. The server answers with
+// SIGNATURES and the same id:
+//   block size  varint
+//   count       varint: full blocks in the server's copy
+//   signatures  for each block, in order, its weak checksum in 4 bytes and
+//               its strong hash in 8, both little-endian
+// or with ERROR, and then nothing more is sent for the file. The client then
+// sends the new contents, size bytes in all, in order, as DATA frames of
+// literal bytes and COPY frames that repeat blocks of the server's copy:
+//   index       varint: the first block
+//   count       varint: blocks from there
+// The server builds the new file in a temporary file next to the old one,
+// renames it into place and answers OK, or ERROR if it could not.
+//
+// With FEATURE_RESUME as well, the server answers a DELTAFILE for a file of
+// RESUME_MIN bytes or more with RESUME instead, if it has no full block of
+// the file to sign. The transfer then goes on as after RESUMEFILE (see
+// wire.h), so a copy made with deltas can be resumed too.
+
+// Smallest file sent as a delta. Smaller ones are sent whole.
+#define DELTA_MIN (64 * 1024)
+
+// Limits on the block size the server picks, and on how many blocks it signs.
+#define DELTA_BLOCK_MIN 2048
+#define DELTA_BLOCK_MAX (8 << 20)
+#define DELTA_BLOCKS_MAX (1 << 20)
+
+// Bytes of one block signature.
+#define SIGNATURE_SIZE 12
+
+// The signatures of a file, as sent in SIGNATURES, with a hash table from
+// weak checksum to the blocks that have it.
+struct sigtable {
+    unsigned block_size;
+    long count;
+    const unsigned char *sigs;  // Points into the SIGNATURES payload.
+    long *heads;                // First block in each bucket, or -1.
+    long *next;                 // Next block in the same bucket, or -1.
+    unsigned long mask;
+};
+
+/* Return the block size to sign a file of size bytes with: about its square
+ * root, so that neither the signatures nor the blocks get large.
+ */
+unsigned delta_block_size(long long size);
+
+/* Return the weak checksum of the len bytes at buf.
+ */
+unsigned weak_sum(const char *buf, size_t len);
+
+/* Return the weak checksum of a window of len bytes, given the checksum sum
+ * of the window one byte earlier, the byte out that left it and the byte in
+ * that joined it.
+ */
+unsigned weak_roll(unsigned sum, unsigned char out, unsigned char in,
+                   size_t len);
+
+/* Add the signatures of the first count blocks of block_size bytes of the
+ * file open on fd to the end of b.
+ * Return 0 on success, or -1 if they can't all be read.
+ */
+int make_signatures(int fd, long count, unsigned block_size, struct wbuf *b);
+
+/* Load the SIGNATURES payload of len bytes at buf into st, which points into
+ * it. Return 0 on success, or -1 if it is malformed.
+ */
+int sigtable_load(struct sigtable *st, const char *buf, size_t len);
+
+/* Return the block in st with the weak checksum weak and the same contents
+ * as the block_size bytes at block, trying the block hint first, or -1 if
+ * there is none.
+ */
+long sigtable_find(const struct sigtable *st, unsigned weak,
+                   const char *block, long hint);
+
+/* Free the hash table of st.
+ */
+void sigtable_free(struct sigtable *st);
+
+#endif // _DELTA_H_
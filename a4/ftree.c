@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <errno.h>
 #include <netdb.h>
@@ -7,61 +8,197 @@
 #include <string.h>
 #include <dirent.h>
 #include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/resource.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "ftree.h"
 #include "hash.h"
+#include "manifest.h"
+#include "delta.h"
+#include "pool.h"
 
 #ifndef PORT
   #define PORT 30000
 #endif
 
+struct rcopy_options rcopy_opts;
 
-/* Add the new client with the filedescriptor fd as the first element of the 
- * struct client top, then return the adjusted top.
+// Clients are allocated this many at a time, and reused once removed.
+#define CLIENT_SLAB 256
+
+// Most events taken from epoll_wait at once.
+#define MAX_EVENTS 256
+
+// Bytes the server is ready to take from a client in one read.
+#define READ_SIZE (256 * 1024)
+
+// Bytes of responses a client may leave unsent before the server stops
+// reading its requests, so neither buffer grows without bound.
+#define OUT_LIMIT (4 * 1024 * 1024)
+
+// Most pieces of file data written with one pwritev.
+#define IOV_BATCH 64
+
+// Bytes inflated from ZDATA frames before they are written out.
+#define ZBUF_SIZE (256 * 1024)
+
+// An event loop with its own listening socket and clients. Reactors share
+// nothing, so each runs on its own thread without taking any locks.
+struct reactor {
+    int sockfd;                     // Listening socket.
+    int epfd;
+    int spare_fd;                   // Given up to turn away a connection
+                                    // when out of fds, or -1.
+    struct client **clients;        // Connected clients, indexed by their fd.
+    int clients_size;
+    struct client *free_clients;    // Clients not in use, linked through next.
+    struct pool_home home;          // Where its clients' jobs come back.
+    pthread_t thread;
+};
+
+
+/* Make fd the index of p in the client table of r, growing the table if
+ * needed.
  */
-static struct client *addclient(struct client *top, int fd) {
-    struct client *p = malloc(sizeof(struct client));
-    // Error check.
-    if (!p) {
-        perror("malloc");
-        exit(1);
+static void setclient(struct reactor *r, int fd, struct client *p) {
+    if (fd >= r->clients_size) {
+        int size = r->clients_size ? r->clients_size : CLIENT_SLAB;
+        while (size <= fd) {
+            size *= 2;
+        }
+        struct client **table = realloc(r->clients, size * sizeof(*table));
+        if (!table) {
+            perror("realloc");
+            exit(1);
+        }
+        memset(table + r->clients_size, 0,
+               (size - r->clients_size) * sizeof(*table));
+        r->clients = table;
+        r->clients_size = size;
+    }
+    r->clients[fd] = p;
+}
+
+
+/* Add the new client with the filedescriptor fd to the client table of r, and
+ * return it.
+ */
+static struct client *addclient(struct reactor *r, int fd) {
+    // Carve a new slab into free clients when they run out.
+    if (!r->free_clients) {
+        struct client *slab = malloc(CLIENT_SLAB * sizeof(struct client));
+        // Error check.
+        if (!slab) {
+            perror("malloc");
+            exit(1);
+        }
+        for (int i = 0; i < CLIENT_SLAB; i++) {
+            slab[i].next = r->free_clients;
+            r->free_clients = &slab[i];
+        }
     }
 
-	p->state = AWAITING_TYPE;
+    struct client *p = r->free_clients;
+    r->free_clients = p->next;
+
+    p->state = AWAITING_HELLO;
+    p->features = 0;
+    p->in = p->out = (struct wbuf){0};
+    p->events = EPOLLIN;
+    p->transfers = NULL;
+    p->ntransfers = 0;
+    p->cur = NULL;
+    p->frame_left = 0;
     p->fd = fd;
-    p->next = top;
-    top = p;
+    p->reactor = r;
+    p->jobs = 0;
+    p->gone = 0;
+    p->next = NULL;
+    setclient(r, fd, p);
     
-    return top;
+    return p;
 }
 
 
-/* Remove the client with the filedescriptor fd in the struct client top, then 
- * return the adjusted top.
+/* Close the file of the transfer t, unlink t from the client p and free it.
  */
-static struct client *removeclient(struct client *top, int fd) {
-    struct client **p;
-    
-    // Finding the target client.
-    for (p = &top; *p && (*p)->fd != fd; p = &(*p)->next);
-    // Now, p points to (1) top, or (2) a pointer to another client
-    // This avoids a special case for removing the head of the list
-    
+static void free_transfer(struct client *p, struct transfer *t) {
+    struct transfer **link = &p->transfers;
+
+    while (*link != t) {
+        link = &(*link)->next;
+    }
+    *link = t->next;
+    p->ntransfers--;
+
+    if (t->fd != -1) {
+        close(t->fd);
+    }
+    if (t->zs) {
+        inflateEnd(t->zs);
+        free(t->zs);
+    }
+    if (t->basis_fd != -1) {
+        close(t->basis_fd);
+    }
+    // A delta that did not make it into place is thrown away, and so is a
+    // partial file that failed. One that was cut off is kept to resume.
+    if (t->tmp_path) {
+        if (t->req.type == DELTAFILE || t->failed) {
+            unlink(t->tmp_path);
+        }
+        free(t->tmp_path);
+    }
+    free(t->req.path);
+    free(t);
+}
+
+
+/* Free what the client p of r holds, and return it to the free clients.
+ */
+static void releaseclient(struct reactor *r, struct client *p) {
+    wbuf_free(&p->in);
+    wbuf_free(&p->out);
+    // The client left partway through sending files.
+    while (p->transfers) {
+        free_transfer(p, p->transfers);
+    }
+    p->next = r->free_clients;
+    r->free_clients = p;
+}
+
+
+/* Remove the client with the filedescriptor fd from the client table of r,
+ * and return it to the free clients. One with jobs still out is only marked
+ * gone, and released once the last of them comes back.
+ */
+static void removeclient(struct reactor *r, int fd) {
     // Found the target client.
-    if (*p) {
-        struct client *t = (*p)->next;
+    if (fd < r->clients_size && r->clients[fd]) {
+        struct client *p = r->clients[fd];
         printf("Removing client %d\n", fd);
-        free(*p);
-        *p = t;
+        r->clients[fd] = NULL;
+        if (p->jobs > 0) {
+            p->gone = 1;
+        } else {
+            releaseclient(r, p);
+        }
     
     // Could not find the target client.
     } else {
         fprintf(stderr, "Error - Remove fd %d\n", fd);
     }
-    
-    return top;
 }
 
 
@@ -72,13 +209,9 @@ static struct client *removeclient(struct client *top, int fd) {
  *       -1 if there is a type mismatch or other error.
  */
 int checkfile(struct request req) {
-	char fullpath[MAXPATH];
-    if (getcwd(fullpath, MAXPATH) == NULL) {
-        perror("getcwd");
-        fprintf(stderr, "Error - Get current working directory\n");
-    };
-	strncat(fullpath, "/", MAXPATH - strlen(fullpath) + 1);
-	strncat(fullpath, req.path, MAXPATH - strlen(fullpath) + 1);
+    // The server runs in the destination directory, so the path relative to
+    // the root of the copy is also the path from here.
+	const char *fullpath = req.path;
 			
     // Case 1: if the request is of type-regular-file.
     if (req.type == 1) {
@@ -114,6 +247,7 @@ int checkfile(struct request req) {
                     perror("fopen");
                     fprintf(stderr, "Error - fopen: on the file at path\n%s\n",
                             fullpath);
+                    return -1;
                 }
                 copy_pass += 1;
             }
@@ -139,26 +273,18 @@ int checkfile(struct request req) {
             }
         }
         
-        // Files are different.
+        // Files are different. The file is overwritten when it is sent; until
+        // then the old copy is kept, for a delta to be made against.
         if (copy_pass != 0) {
 			if (fclose(fp) != 0) {
 				perror("fclose");
 				return -1;
 			}
-            
-            // We need to overwrite the file.
-            // Empty the file firstly.
-			fp = fopen(fullpath, "w"); 
-			if (fp == NULL) {
-				perror("fopen");
-                fprintf(stderr, "Error - fopen: on the file at path\n%s\n",
-                        fullpath);
-				return -1;
-			}
         	return 1;
         
         // Files are the same.
         } else {
+            fclose(fp);
             if (chmod(fullpath, req.mode & 0777)) {
                 perror("chmod");
 				return -1; 
@@ -216,541 +342,2347 @@ int checkfile(struct request req) {
 }
 
 
-/* Receive client's info. based on its status, and update its status after read.
- * Return 0 for success and no further actions needed, 
- *       -1 for error and stop reading,
- *        1 for TRANSFILE request to be sent to this client,
- *        2 for OK request to be sent,
- *        3 if client has closed.
+/* Watch the client p of r for room to send while it has responses waiting,
+ * and stop reading its requests while too many are.
+ * Return 0 for success, or 3 if the client must be dropped.
  */
-int handleclient(struct client *p, struct client *top) {
-    // Get info. in the order: type, path, mode, hash, size.
-    
-    if (p->state == AWAITING_TYPE) {
-		int buf;
-		int numread = read(p->fd, &buf, sizeof(p->req.type));
-		
-        // Client has closed the socket, it should be removed.
-        if (numread == 0) {
-			return 3;
-        } else if (numread <0) {
-            perror("read");
-            fprintf(stderr, "Error - read: Read initial request\n");
-        }
-		
-        p->req.type = ntohs(buf);
-		p->state = AWAITING_PATH;
+static int watchclient(struct reactor *r, struct client *p) {
+    unsigned events = (p->out.len < OUT_LIMIT ? EPOLLIN : 0) |
+                      (p->out.len > 0 ? EPOLLOUT : 0);
 
-	} else if (p->state == AWAITING_PATH) {
-        if (read(p->fd, &p->req.path, MAXPATH) < 0) {
-            perror("read");
-            fprintf(stderr, "Error - read: Read path from client\n");
+    if (events != p->events) {
+        struct epoll_event ev;
+        ev.events = events;
+        ev.data.fd = p->fd;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_MOD, p->fd, &ev) == -1) {
+            perror("epoll_ctl");
+            return 3;
         }
-		p->state = AWAITING_PERM;
+        p->events = events;
+    }
+    return 0;
+}
 
-	} else if (p->state == AWAITING_PERM) {
-        if (read(p->fd, &p->req.mode, sizeof(p->req.mode)) < 0) {
-            perror("read");
-            fprintf(stderr, "Error - read: Read mode for relative path %s\n",
-                    p->req.path);
-        }
-		p->state = AWAITING_HASH;
 
-	} else if (p->state == AWAITING_HASH) {
-        if (read(p->fd, &p->req.hash, BLOCKSIZE) < 0) {
-            perror("read");
-            fprintf(stderr, "Error - read: Read hash for relative path %s\n",
-                    p->req.path);
-        }
-		p->state = AWAITING_SIZE;
+/* Queue a response of type to the request id for the client p.
+ */
+static void respond(struct client *p, int type, unsigned id,
+                    const void *payload, size_t len) {
+    wbuf_frame(&p->out, type, id, payload, len);
+}
 
-	} else if (p->state == AWAITING_SIZE) {
-		int buf;
-        
-		if (read(p->fd, &buf, sizeof(p->req.size)) < 0 ) {
-			perror("read");
-            fprintf(stderr, "Error - read: Read size for relative path %s\n",
-                    p->req.path);
-			return -1; 
-		}
-        
-		p->req.size = ntohs(buf);
 
-		// Move to accept Data state if type is TRANSFILE.
-        if (p->req.type == TRANSFILE) {
-			p->state = AWAITING_DATA;
+/* Answer the HELLO frame f from the client p with the version both will use.
+ * Return 0 on success, or 3 if the client can't be served.
+ */
+static int hello(struct client *p, const struct frame *f) {
+    unsigned long long version, features;
+    int n;
 
-		//restart the state machine if it's not a TRANSFILE request.
-		} else {
-			int check = checkfile(p->req);
-			p->state = AWAITING_TYPE;
-			
-			// Return different value depending on check's return value.
-            // 0: OK request to be sent.
-            if (check == 0) {
-				return 2;
-                
-            // -1: error and stop reading.
-			} else if (check == -1) {
-				return -1;
-                
-            // 1: TRANSFILE request to be sent to this client.
-			} else if (check == 1) {
-				return 1;
-			}
-		}
-    
-    // Transfer data and update the file.
-	} else if (p->state == AWAITING_DATA) {
-		char fullpath[MAXPATH];
-		getcwd(fullpath, MAXPATH);
-		strncat(fullpath, "/", MAXPATH - strlen(fullpath) + 1);
-		strncat(fullpath, p->req.path, MAXPATH - strlen(fullpath) + 1);
-			
-		// "fpow" stands for "file pointer (to be) over writen."
-		FILE * fpow = fopen(fullpath, "a");
-		if (fpow == NULL) {
-			perror("fopen");
-			fprintf(stderr, "Error - opening file for appending %s \n",
-                    fullpath);
-			return -1;
-		}
-        
-		char bufdata[MAXDATA];
-		int num_read = read(p->fd, bufdata, sizeof(bufdata)); // Error check below.
-		int num_written = 0; // Set to 0 as default.
+    if (f->type != HELLO || f->len < strlen(RCOPY_MAGIC) ||
+        memcmp(f->payload, RCOPY_MAGIC, strlen(RCOPY_MAGIC)) != 0) {
+        fprintf(stderr, "Error - Client %d does not speak rcopy\n", p->fd);
+        return 3;
+    }
+    const char *pos = f->payload + strlen(RCOPY_MAGIC);
+    size_t len = f->len - strlen(RCOPY_MAGIC);
+    if ((n = get_varint(pos, len, &version)) <= 0 ||
+        get_varint(pos + n, len - n, &features) <= 0 ||
+        version < RCOPY_VERSION) {
+        fprintf(stderr, "Error - Client %d wants an unknown version\n", p->fd);
+        respond(p, ERROR, f->id, NULL, 0);
+        return 3;
+    }
 
-		if (num_read < 0) {
-			perror("read");
-			fprintf(stderr, "Error: Reading data for file %s\n", fullpath);
-			return -1;
-        
-        // Check if it is the last data transfer.
-		} else if (num_read < 256) {
-			if (fwrite(bufdata, sizeof(char), num_read, fpow) != num_read) {
-				perror("fwrite");
-				fprintf(stderr, "Error - writing data for file %s\n", fullpath);
-				return -1;
-			}
-            
-			p->state = AWAITING_TYPE;
-            
-            if (chmod(fullpath, p->req.mode & (0777))) {
-				perror("chmod");
-				fprintf(stderr, "Error - chmod: for file %s\n", fullpath);
-				return -1;
-			}
-         
-        // All data is not yet transfered.
-		} else {
-			num_written = fwrite(bufdata, sizeof(char), MAXDATA, fpow);
-		}
-		
-        if (fclose(fpow) != 0) {
-			perror("fclose");
-			return -1;
-		}
-		
-        // Error check for fwrite in else block above.
-		if (num_written < 0) {
-			perror("fwrite");
-			return -1;
-		}
-        // Return 2 so that an OK request is sent.
-		return 2;
-	}
-    // Return 0 so that no request is sent.
-	return 0;
+    // Agree to the features asked for that the server has.
+    p->features = features & FEATURES;
+    struct wbuf reply = {0};
+    wbuf_put(&reply, RCOPY_MAGIC, strlen(RCOPY_MAGIC));
+    wbuf_varint(&reply, RCOPY_VERSION);
+    wbuf_varint(&reply, p->features);
+    respond(p, HELLO, f->id, reply.data, reply.len);
+    wbuf_free(&reply);
+
+    p->state = AWAITING_TYPE;
+    return 0;
 }
 
 
-/* Setup the socket. Return the file-descriptor, which is an endpoint for 
- * communication. Return 1 if there is an error.
- */
-int setup_server(void) {
-	int on = 1;
-  	struct sockaddr_in self;
-  	int listenfd;
-  	
-    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-    	perror("socket");
-    	exit(1);
-  	}
+// File data received in one read, waiting to be written with one pwritev.
+// The pieces point into the input buffer of the client being handled, and
+// all belong to the transfer iov_owner.
+static __thread struct iovec iov[IOV_BATCH];
+static __thread int iovcnt;
+static __thread size_t iovbytes;
+static __thread struct transfer *iov_owner;
 
-  	// Make sure to reuse the port immediately after the server terminates.
-  	if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
-    	             &on, sizeof(on)) == -1) {
-    	perror("setsockopt -- REUSEADDR");
-  	}
 
-  	memset(&self.sin_zero, '\0', sizeof(self));
-  	self.sin_family = AF_INET;
-  	self.sin_addr.s_addr = INADDR_ANY;
-  	self.sin_port = htons(PORT);
-  	printf("Listening on %d\n", PORT);
+/* Write the data waiting in iov to the file of the transfer t, where it
+ * belongs. A failed write fails the transfer, which carries on to the end
+ * without writing anything more.
+ */
+static void write_data(struct transfer *t) {
+    off_t offset = t->req.size - t->remaining - iovbytes;
+    struct iovec *v = iov;
+    int count = iovcnt;
 
-  	if (bind(listenfd, (struct sockaddr *)&self, sizeof(self)) < 0) {
-    	perror("bind");
-		close(listenfd);
-    	exit(1);
-  	}
+    while (count > 0 && !t->failed) {
+        ssize_t n = pwritev(t->fd, v, count, offset);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pwritev");
+            fprintf(stderr, "Error - writing data for file %s\n", t->req.path);
+            t->failed = 1;
+            break;
+        }
+        offset += n;
 
-  	if (listen(listenfd, 5) < 0) {
-    	perror("listen");
-		close(listenfd);
-    	exit(1);
-  	}
-  
-  	return listenfd;
+        // Skip what has been written, which may end partway through a piece.
+        while (count > 0 && n >= v->iov_len) {
+            n -= v->iov_len;
+            v++;
+            count--;
+        }
+        if (count > 0) {
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+    iovcnt = 0;
+    iovbytes = 0;
+    iov_owner = NULL;
 }
 
 
-/* Listen for and handle all requests from clients.
+/* Finish the transfer t the client p has sent all of, and answer it.
  */
-void rcopy_server(unsigned short port) {
-	// The fd for the socket.
-	int sockfd;
-
-	// Setup the socket for the server.
- 	sockfd = setup_server();
+static void end_transfer(struct client *p, struct transfer *t) {
+    if (iov_owner == t) {
+        write_data(t);
+    }
+    if (!t->failed && fchmod(t->fd, t->req.mode & (0777))) {
+        perror("fchmod");
+        fprintf(stderr, "Error - chmod: for file %s\n", t->req.path);
+        t->failed = 1;
+    }
 
-	// The fd for the client pulled from the queue in the socket.
- 	int clientfd;
+    // A delta or partial file replaces the old copy only once it is complete.
+    if (!t->failed && t->tmp_path) {
+        if (rename(t->tmp_path, t->req.path) == -1) {
+            perror("rename");
+            fprintf(stderr, "Error - replacing file %s\n", t->req.path);
+            t->failed = 1;
+        } else {
+            free(t->tmp_path);
+            t->tmp_path = NULL;
+        }
+    }
+    respond(p, t->failed ? ERROR : OK, t->req.id, NULL, 0);
+    free_transfer(p, t);
+}
 
-	// Maximum fd as upper bound for select function.
-	int maxfd;
 
-	// allfds is master list of connections, listen_fds is copy for select function.
-	fd_set allfds, listenfds;
+/* Take the len bytes at data as the next part of the file of the transfer t
+ * from the client p.
+ */
+static void add_data(struct client *p, struct transfer *t, const char *data,
+                     size_t len) {
+    if (!t->failed && len > 0) {
+        if (iovcnt > 0 && (iov_owner != t || iovcnt == IOV_BATCH)) {
+            write_data(iov_owner);
+        }
+        iov[iovcnt].iov_base = (char *)data;
+        iov[iovcnt].iov_len = len;
+        iovcnt++;
+        iovbytes += len;
+        iov_owner = t;
+    }
 
-	// Empty allfds so that it doesn't contain any garbage.
-	FD_ZERO(&allfds);
+    t->remaining -= len;
+    if (t->remaining == 0) {
+        end_transfer(p, t);
+    }
+}
 
-	// Add the socket to allfds.
-	FD_SET(sockfd, &allfds);
-	
-	struct client *p;
-	struct client *head = NULL; 
-		
- 	struct sockaddr_in peer;
- 	socklen_t socklen;
 
-	// Set the initial upper bound to the value of the only fd in the set.
-	maxfd = sockfd;
+/* Inflate the len bytes at data as the next part of the zlib stream of the
+ * transfer t from the client p, and write out what they hold. The transfer
+ * ends with the stream; if that is not at the size of the file, it fails.
+ * Return 0 on success, or 3 if the stream is corrupt or does not end with
+ * the frame.
+ */
+static int add_zdata(struct client *p, struct transfer *t, const char *data,
+                     size_t len) {
+    static __thread char out[ZBUF_SIZE];
+    int ret;
 
- 	while (1) {
-		// Copy allfds into listenfds so select doesn't manipulate master set of fds.
-		listenfds = allfds;
+    t->zs->next_in = (Bytef *)data;
+    t->zs->avail_in = len;
+    do {
+        t->zs->next_out = (Bytef *)out;
+        t->zs->avail_out = sizeof(out);
+        ret = inflate(t->zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            fprintf(stderr, "Error - Corrupt data for file %s\n", t->req.path);
+            return 3;
+        }
 
-		int nready = select(maxfd + 1, &listenfds, NULL, NULL, NULL);
-		// Error check select.
-		if (nready == -1) {
-			perror("select");
-			exit(1);
-		}
-	
-		// Check if the original socket is in the set, then create a new connection.
-		if (FD_ISSET(sockfd, &listenfds)) {
-			socklen = sizeof(peer);
-			// Pass in valid pointers for the second and third arguments to accept 
-    		// here to store and use client information.
-    		if ((clientfd = accept(sockfd,
-                                   (struct sockaddr *)&peer, &socklen)) < 0) {
-      			perror("accept");
-    		}
-      		
-			// Update maxfd if necessary.
-			if (clientfd > maxfd) {
-				maxfd = clientfd;
-			}
-			// Add new fd to master set of all fds.
-			FD_SET(clientfd, &allfds);
-			// Report successful connection to stdout.
-			printf("New connection on port %d\n", ntohs(peer.sin_port));
-			head = addclient(head, clientfd);
-		}
+        size_t n = sizeof(out) - t->zs->avail_out;
+        if (n > t->remaining) {
+            fprintf(stderr, "Error - Too much data for file %s\n",
+                    t->req.path);
+            t->failed = 1;
+            n = t->remaining;
+        }
+        off_t offset = t->req.size - t->remaining;
+        for (size_t done = 0; done < n && !t->failed; ) {
+            ssize_t written = pwrite(t->fd, out + done, n - done,
+                                     offset + done);
+            if (written == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("pwrite");
+                fprintf(stderr, "Error - writing data for file %s\n",
+                        t->req.path);
+                t->failed = 1;
+                break;
+            }
+            done += written;
+        }
+        t->remaining -= n;
+    } while (ret != Z_STREAM_END && t->zs->avail_out == 0);
 
-		for (int i = 0; i <= maxfd; i++) {
-			if (FD_ISSET(i, &listenfds)) {
-				for (p = head; p != NULL; p = p->next) {
-					if (p->fd == i) {
-						
-                        // Read and manage data sent from the client.
-                        int result = handleclient(p,head);
-						
-                        // Remove the client.
-                        if (result == 3) {
-							int tmpfd = p->fd;
-							head = removeclient(head, p->fd);
-							FD_CLR(tmpfd, &allfds);
-							close(tmpfd);
-						
-                        } else if (result != 0) {
-							// Make the type appropriate given result from
-							// function checkfile.
-							if (result == 1) {
-								p->req.type = SENDFILE;
-							} else if (result == 2) {
-								p->req.type = OK;
-							} else {
-								p->req.type = ERROR;
-							}
-
-							// Write request to socket.
-							int typebuf = htons(p->req.type);
-        					if (write(p->fd, &typebuf, sizeof(typebuf)) == -1) {
-								perror("write");
-							}
-							printf("Request of type %d\n", p->req.type);
-						}
-						break;
-					}
-				}
-			}
-		}			    	
-  	}
+    if (ret == Z_STREAM_END) {
+        if (t->zs->avail_in > 0 || p->frame_left > 0) {
+            fprintf(stderr, "Error - Data after the end of file %s\n",
+                    t->req.path);
+            return 3;
+        }
+        if (t->remaining > 0) {
+            fprintf(stderr, "Error - Too little data for file %s\n",
+                    t->req.path);
+            t->failed = 1;
+        }
+        end_transfer(p, t);
+    }
+    return 0;
 }
 
 
-//Code below this comment handles the client.
+/* Return the transfer with the request id from the client p, or NULL if
+ * there is none.
+ */
+static struct transfer *find_transfer(struct client *p, unsigned id) {
+    struct transfer *t = p->transfers;
 
+    while (t && t->req.id != id) {
+        t = t->next;
+    }
+    return t;
+}
 
-/* Generate the information of file/directory rooted at parents concatenated
- * with path, and return the corresponding struct request.
+
+/* Get ready to inflate ZDATA frames for the transfer t from the client p.
+ * Return 0 on success, or -1 if the client did not agree to send them, has
+ * already sent DATA frames for t or is sending t as a delta.
  */
-struct request request_generator(const char *parent, char *path) {
-    struct request req;
-    struct stat st;
-    
-    // Get the fullpath of the file/directory.
-    // fullpath = parent + path
-    char fullpath[MAXPATH];
-    strncpy(fullpath, parent, MAXPATH);
-    strncat(fullpath, "/", 2);
-    strncat(fullpath, path, strlen(path) + 1);
-    
-    // Check if fullpath if valid.
-    if (lstat(fullpath, &st) == -1) {
-        perror("lstat");
-        exit(EXIT_FAILURE);
+static int start_zdata(struct client *p, struct transfer *t) {
+    if (t->zs) {
+        return 0;
     }
-    
-    // Case 0: If fullpath is a link, we will set request's type as 0. Then it
-    // will not be copied.
-    if (S_ISLNK(st.st_mode)){
-        req.type = 0;
-        return req;
+    if (!(p->features & FEATURE_ZLIB) ||
+        t->remaining != t->req.size - t->start || t->req.type == DELTAFILE) {
+        return -1;
     }
-    
-    // Pass in the file/directory's path, size and mode.
-    strncpy(req.path, path, MAXPATH);
-    req.size = st.st_size;
-    req.mode = st.st_mode;
-    
-    // Case 1: If fullpath is a regular file.
-    // We need to get the hash value of the file.
-    if(S_ISREG(st.st_mode)) {
-        req.type = 1;
-        
-        FILE *fp = fopen(fullpath, "r");
-        if (fp == NULL) {
-            perror("fopen");
-            fprintf(stderr, "Error - fopen: opening file %s\n", fullpath);
-            exit(1);
-            // This could cause problems exiting stopping the recursion, but
-            // we did not have time to implement it as a return error in order
-            // to continue on with the recursion and close the socket properly.
-            
-        }
-        
-        hash(req.hash, fp);
-        
-    // Case 2: If fullpath is a directory.
-    } else if (S_ISDIR(st.st_mode)) {
-        req.type = 2;
+
+    t->zs = calloc(1, sizeof(z_stream));
+    if (!t->zs) {
+        perror("calloc");
+        exit(1);
     }
-    
-    return req;
+    if (inflateInit(t->zs) != Z_OK) {
+        fprintf(stderr, "Error - inflateInit\n");
+        exit(1);
+    }
+    return 0;
 }
 
 
-/* Return the basename of file rooted at the path fname.
+/* Add a transfer for the request req from the client p, which the transfer
+ * takes over, with nothing open yet.
+ * Return the transfer, or NULL if the client must be dropped.
  */
-char *get_basename(const char *fname) {
-    char *basec, *bname;
-    basec = strdup(fname);
-    bname = basename(basec);
-    
-    return bname;
+static struct transfer *new_transfer(struct client *p, struct request *req) {
+    if (p->ntransfers == MAX_TRANSFERS || find_transfer(p, req->id)) {
+        fprintf(stderr, "Error - Too many transfers from client %d\n", p->fd);
+        free(req->path);
+        return NULL;
+    }
+
+    struct transfer *t = malloc(sizeof(struct transfer));
+    if (!t) {
+        perror("malloc");
+        exit(1);
+    }
+    t->req = *req;
+    t->remaining = req->size;
+    t->start = 0;
+    t->resuming = 0;
+    t->busy = 0;
+    t->fd = -1;
+    t->failed = 0;
+    t->zs = NULL;
+    t->tmp_path = NULL;
+    t->basis_fd = -1;
+    t->block_size = 0;
+    t->blocks = 0;
+    t->next = p->transfers;
+    p->transfers = t;
+    p->ntransfers++;
+    return t;
 }
 
 
-/* Traverse file tree rooted at fullpath(parent + path). Return 0 on success, 
- * or 1 on failure.
+/* Open the partial file of the transfer t for writing, with flags besides
+ * O_CREAT. If it can't be, t fails.
  */
-int traverse_ftree(const char *parent, char *path, int soc, char *host) {
-    struct request req = request_generator(parent, path);
-   
-	char fullpath[MAXPATH];
-    // Set fullpath to be the absolute path of the file or directory.
-    strncpy(fullpath, parent, MAXPATH);
-    strncat(fullpath, "/", 2);
-    strncat(fullpath, path, strlen(path) + 1);
- 
-    // Case 1: If fullpath is not a link, then it might be a
-    // file/direcoty. Need transfer the info. to the server.
-    if (req.type != 0) {
-        // Translate any numeric types to network order in case the systems
-        // have different endians.
-        int typebuf = htons(req.type);
-        if (write(soc, &typebuf, sizeof(typebuf)) == -1) {
-			perror("write");
-			exit(1);
-            // Exit instead of return because if returned the server would be
-            // out of sync with the client anyway and so incorrect data could be
-            // written to the client.
-		}
-        
-        if (write(soc, &req.path, MAXPATH) == -1) {
-			perror("write");
-			exit(1);
-		}
-        
-        if (write(soc, &req.mode, sizeof(req.mode)) == -1) {
-			perror("write");
-			exit(1);
-		}
-        
-        if (write(soc, &req.hash, BLOCKSIZE) == -1) {
-			perror("write");
+static void open_part(struct transfer *t, int flags) {
+    t->tmp_path = malloc(strlen(t->req.path) + sizeof(PART_SUFFIX));
+    if (!t->tmp_path) {
+        perror("malloc");
+        exit(1);
+    }
+    sprintf(t->tmp_path, "%s" PART_SUFFIX, t->req.path);
+    if ((t->fd = open(t->tmp_path, O_RDWR | O_CREAT | flags, 0600)) == -1) {
+        perror("open");
+        fprintf(stderr, "Error - opening file for writing %s \n", t->tmp_path);
+        free(t->tmp_path);
+        t->tmp_path = NULL;
+        t->failed = 1;
+    }
+}
+
+
+// What a job reads for a client.
+#define JOB_CHECK 0         // checkfile on a REGFILE request.
+#define JOB_RESUME 1        // The hash of what a partial file holds.
+#define JOB_SIGNATURES 2    // The signatures of the old copy for a delta.
+#define JOB_MANIFEST 3      // checkfile on a chunk of a manifest's files.
+
+// A manifest whose files are being checked, a chunk per job, and which is
+// answered once the last of them is back.
+struct manifest_check {
+    struct request *reqs;
+    int count;
+    unsigned id;            // Of the MANIFEST frame.
+    struct wbuf reply;      // The count, then the two bitmaps.
+    size_t bitmaps;         // Where the bitmaps start in reply.
+    int left;               // Jobs not back yet.
+};
+
+// A request whose files are read on a worker, and answered once it is back
+// on the reactor of the client (see pool.h).
+struct file_job {
+    struct job job;         // First, so a pointer to it is one to the whole.
+    int kind;
+    struct client *p;
+    struct transfer *t;     // The transfer it is for, which is busy until
+                            // the job is back, or NULL.
+    struct request req;     // The request of JOB_CHECK, which it owns.
+    int check;              // What checkfile returned.
+    unsigned long long h;   // The hash for JOB_RESUME.
+    struct wbuf sigs;       // The payload of SIGNATURES for JOB_SIGNATURES.
+    struct manifest_check *m;   // The manifest of JOB_MANIFEST, and the
+    int start, end;             // entries of it to check.
+};
+
+
+/* Free the manifest m, with its entries.
+ */
+static void free_manifest(struct manifest_check *m) {
+    for (int i = 0; i < m->count; i++) {
+        free(m->reqs[i].path);
+    }
+    free(m->reqs);
+    wbuf_free(&m->reply);
+    free(m);
+}
+
+
+/* Read what the file job needs. Runs on a worker, which has the transfer to
+ * itself while it is busy.
+ */
+static void run_job(struct job *job) {
+    struct file_job *j = (struct file_job *)job;
+    struct transfer *t = j->t;
+    struct stat part_stat;
+
+    if (j->kind == JOB_CHECK) {
+        j->check = checkfile(j->req);
+
+    } else if (j->kind == JOB_MANIFEST) {
+        unsigned char *need = (unsigned char *)j->m->reply.data +
+                              j->m->bitmaps;
+        check_files(j->m->reqs, j->start, j->end, need,
+                    need + BITMAP_SIZE(j->m->count));
+
+    } else if (j->kind == JOB_RESUME) {
+        if (fstat(t->fd, &part_stat) == -1) {
+            perror("fstat");
+            t->failed = 1;
+            return;
+        }
+        // A partial file longer than the file must be of something else.
+        t->start = part_stat.st_size <= t->req.size ? part_stat.st_size : 0;
+        if (hash_prefix(t->fd, t->start, &j->h) == -1) {
+            fprintf(stderr, "Error - reading file %s\n", t->tmp_path);
+            t->failed = 1;
+        }
+
+    } else {
+        wbuf_varint(&j->sigs, t->block_size);
+        wbuf_varint(&j->sigs, t->blocks);
+        if (make_signatures(t->basis_fd, t->blocks, t->block_size,
+                            &j->sigs) == -1) {
+            fprintf(stderr, "Error - reading file %s\n", t->req.path);
+            t->failed = 1;
+        }
+    }
+}
+
+
+/* Answer the request of the file job, back on the reactor of its client, and
+ * free the job. A manifest is answered with the last of its jobs. A client
+ * that has gone is released with its last job.
+ */
+static void finish_job(struct job *job) {
+    struct file_job *j = (struct file_job *)job;
+    struct client *p = j->p;
+    struct transfer *t = j->t;
+    struct manifest_check *m = j->m;
+    struct wbuf resume = {0};
+
+    p->jobs--;
+    if (m && --m->left > 0) {
+        m = NULL;
+
+    } else if (p->gone) {
+        if (p->jobs == 0) {
+            releaseclient(p->reactor, p);
+        }
+
+    } else {
+        if (j->kind == JOB_CHECK) {
+            respond(p, j->check == 0 ? OK : j->check == 1 ? SENDFILE : ERROR,
+                    j->req.id, NULL, 0);
+        } else if (j->kind == JOB_MANIFEST) {
+            respond(p, OK, m->id, m->reply.data, m->reply.len);
+            printf("Manifest of %d entries for %u\n", m->count, m->id);
+        } else if (t->failed) {
+            respond(p, ERROR, t->req.id, NULL, 0);
+            free_transfer(p, t);
+        } else if (j->kind == JOB_RESUME) {
+            t->busy = 0;
+            wbuf_varint(&resume, t->start);
+            wbuf_varint(&resume, j->h);
+            respond(p, RESUME, t->req.id, resume.data, resume.len);
+        } else {
+            t->busy = 0;
+            respond(p, SIGNATURES, t->req.id, j->sigs.data, j->sigs.len);
+        }
+
+        // Nothing else may be coming from the client to send the answer with.
+        if (flushclient(p) == 3 || watchclient(p->reactor, p) == 3) {
+            int fd = p->fd;
+            removeclient(p->reactor, fd);
+            close(fd);
+        }
+    }
+
+    if (m) {
+        free_manifest(m);
+    }
+    free(j->req.path);
+    wbuf_free(&j->sigs);
+    wbuf_free(&resume);
+    free(j);
+}
+
+
+/* Return a new job of kind for the client p, for the transfer t or NULL.
+ */
+static struct file_job *new_job(struct client *p, int kind,
+                                struct transfer *t) {
+    struct file_job *j = calloc(1, sizeof(struct file_job));
+
+    if (!j) {
+        perror("calloc");
+        exit(1);
+    }
+    j->job.run = run_job;
+    j->job.done = finish_job;
+    j->job.home = &p->reactor->home;
+    j->kind = kind;
+    j->p = p;
+    j->t = t;
+    return j;
+}
+
+
+/* Queue the job j for a worker. Its transfer is busy until it is back.
+ */
+static void queue_job(struct file_job *j) {
+    if (j->t) {
+        j->t->busy = 1;
+    }
+    j->p->jobs++;
+    pool_submit(&j->job);
+}
+
+
+/* Check the entries of the MANIFEST frame f from the client p, and answer
+ * with which of them the server needs the contents of and which failed.
+ * Directories are made here, in order, and the files are then checked a
+ * chunk at a time on the workers.
+ * Return 0 on success, or 3 if the manifest is malformed.
+ */
+static int answer_manifest(struct client *p, const struct frame *f) {
+    unsigned long long count;
+    size_t pos;
+    int n;
+
+    if ((n = get_varint(f->payload, f->len, &count)) <= 0 || count < 1 ||
+        count > MANIFEST_MAX) {
+        fprintf(stderr, "Error - Manifest from client %d\n", p->fd);
+        return 3;
+    }
+    pos = n;
+
+    struct manifest_check *m = calloc(1, sizeof(struct manifest_check));
+    if (!m || !(m->reqs = calloc(count, sizeof(struct request)))) {
+        perror("calloc");
+        exit(1);
+    }
+    m->count = count;
+    m->id = f->id;
+
+    // The reply is the count, then the two bitmaps.
+    wbuf_varint(&m->reply, count);
+    m->bitmaps = m->reply.len;
+    wbuf_reserve(&m->reply, 2 * BITMAP_SIZE(count));
+    memset(m->reply.data + m->bitmaps, 0, 2 * BITMAP_SIZE(count));
+    m->reply.len += 2 * BITMAP_SIZE(count);
+
+    for (int i = 0; i < count; i++) {
+        struct request *req = &m->reqs[i];
+        if (pos == f->len ||
+            (n = get_entry(f->payload + pos + 1, f->len - pos - 1,
+                           (unsigned char)f->payload[pos], req)) == -1) {
+            fprintf(stderr, "Error - Manifest from client %d\n", p->fd);
+            free_manifest(m);
+            return 3;
+        }
+        pos += 1 + n;
+        // Anything but a file or directory fails on its own.
+        if (!safe_path(req->path) ||
+            (req->type != REGFILE && req->type != REGDIR)) {
+            req->type = 0;
+        }
+    }
+
+    unsigned char *need = (unsigned char *)m->reply.data + m->bitmaps;
+    if (check_dirs(m->reqs, count, need, need + BITMAP_SIZE(count)) == 0) {
+        respond(p, OK, m->id, m->reply.data, m->reply.len);
+        printf("Manifest of %llu entries for %u\n", count, m->id);
+        free_manifest(m);
+        return 0;
+    }
+
+    // Every job is counted before any can come back.
+    m->left = (count + CHECK_CHUNK - 1) / CHECK_CHUNK;
+    for (int start = 0; start < count; start += CHECK_CHUNK) {
+        struct file_job *j = new_job(p, JOB_MANIFEST, NULL);
+        j->m = m;
+        j->start = start;
+        j->end = start + CHECK_CHUNK < count ? start + CHECK_CHUNK : count;
+        queue_job(j);
+    }
+    return 0;
+}
+
+
+/* Start taking the file the client p is about to send, as described in the
+ * TRANSFILE request req, which the transfer takes over. The file is opened
+ * once here, and kept open until it is all written; a large one is written
+ * to its partial file from the start. If it can't be opened, the data is
+ * still taken, to stay in step with the client, and the transfer fails at
+ * the end.
+ * Return 0 on success, or 3 if the client must be dropped.
+ */
+static int start_transfer(struct client *p, struct request *req) {
+    struct transfer *t = new_transfer(p, req);
+
+    if (!t) {
+        return 3;
+    }
+    if (!safe_path(t->req.path)) {
+        fprintf(stderr, "Error - Path outside destination: %s\n",
+                t->req.path);
+        t->failed = 1;
+    } else if (t->req.size >= RESUME_MIN) {
+        open_part(t, O_TRUNC);
+    } else if ((t->fd = open(t->req.path,
+                             O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+        perror("open");
+        fprintf(stderr, "Error - opening file for writing %s \n", t->req.path);
+        t->failed = 1;
+    }
+    if (t->remaining == 0) {
+        end_transfer(p, t);
+    }
+    return 0;
+}
+
+
+/* Take the data of the transfer t from the client p into its partial file,
+ * after what that holds already. The client is sent how much that is, with a
+ * hash of it to check against its own file, once a worker has read it. If
+ * the partial file can't be opened or read, the request is answered with
+ * ERROR.
+ */
+static void resume_part(struct client *p, struct transfer *t) {
+    t->resuming = 1;
+    open_part(t, 0);
+
+    if (t->failed) {
+        respond(p, ERROR, t->req.id, NULL, 0);
+        free_transfer(p, t);
+    } else {
+        queue_job(new_job(p, JOB_RESUME, t));
+    }
+}
+
+
+/* Start taking the file the client p is about to send, as described in the
+ * RESUMEFILE request req, which is taken over, after what its partial file
+ * holds already.
+ * Return 0 on success, or 3 if the client must be dropped.
+ */
+static int start_resume(struct client *p, struct request *req) {
+    if (!(p->features & FEATURE_RESUME)) {
+        fprintf(stderr, "Error - Unexpected resume from client %d\n", p->fd);
+        free(req->path);
+        return 3;
+    }
+    struct transfer *t = new_transfer(p, req);
+    if (!t) {
+        return 3;
+    }
+
+    if (!safe_path(t->req.path)) {
+        fprintf(stderr, "Error - Path outside destination: %s\n",
+                t->req.path);
+        respond(p, ERROR, t->req.id, NULL, 0);
+        free_transfer(p, t);
+    } else {
+        resume_part(p, t);
+    }
+    return 0;
+}
+
+
+/* Start the data of the transfer the RESUMEAT frame f from the client p is
+ * for at the offset it holds, which is at most what the partial file held.
+ * Anything in the partial file past it is cut off.
+ * Return 0 on success, or 3 if the client must be dropped.
+ */
+static int resume_at(struct client *p, const struct frame *f) {
+    struct transfer *t = find_transfer(p, f->id);
+    unsigned long long offset;
+
+    if (!t || !t->resuming || t->busy ||
+        get_varint(f->payload, f->len, &offset) != f->len ||
+        offset > t->start) {
+        fprintf(stderr, "Error - Unexpected resume for %u from client %d\n",
+                f->id, p->fd);
+        return 3;
+    }
+    t->resuming = 0;
+    t->start = offset;
+    t->remaining = t->req.size - offset;
+    if (ftruncate(t->fd, offset) == -1) {
+        perror("ftruncate");
+        fprintf(stderr, "Error - truncating file %s\n", t->tmp_path);
+        t->failed = 1;
+    }
+    if (t->remaining == 0) {
+        end_transfer(p, t);
+    }
+    return 0;
+}
+
+
+/* Start taking the file the client p is about to send as a delta, as
+ * described in the DELTAFILE request req, which is taken over. The new file
+ * is built in a temporary file next to the old copy, and the client is sent
+ * the signatures of the old copy's blocks to work out the delta from, once a
+ * worker has made them. If there is no old copy, there are no signatures,
+ * and the client sends all of it; a large file is then taken as a resume
+ * instead, into its partial file. If anything can't be set up, the request
+ * is answered with ERROR.
+ * Return 0 on success, or 3 if the client must be dropped.
+ */
+static int start_delta(struct client *p, struct request *req) {
+    struct stat basis_stat;
+
+    if (!(p->features & FEATURE_DELTA)) {
+        fprintf(stderr, "Error - Unexpected delta from client %d\n", p->fd);
+        free(req->path);
+        return 3;
+    }
+    struct transfer *t = new_transfer(p, req);
+    if (!t) {
+        return 3;
+    }
+
+    if (!safe_path(t->req.path)) {
+        fprintf(stderr, "Error - Path outside destination: %s\n",
+                t->req.path);
+        t->failed = 1;
+    } else if ((t->basis_fd = open(t->req.path, O_RDONLY)) == -1 &&
+               errno != ENOENT) {
+        perror("open");
+        fprintf(stderr, "Error - opening file for reading %s\n", t->req.path);
+        t->failed = 1;
+    } else if (t->basis_fd != -1 && fstat(t->basis_fd, &basis_stat) == -1) {
+        perror("fstat");
+        t->failed = 1;
+    }
+
+    if (!t->failed) {
+        t->block_size = delta_block_size(t->req.size);
+        if (t->basis_fd != -1) {
+            t->blocks = basis_stat.st_size / t->block_size;
+            if (t->blocks > DELTA_BLOCKS_MAX) {
+                t->blocks = DELTA_BLOCKS_MAX;
+            }
+        }
+    }
+
+    // With no blocks to copy, all of the file comes as data, so a large one
+    // goes to its partial file, which is kept to resume if it is cut off.
+    if (!t->failed && t->blocks == 0 && t->req.size >= RESUME_MIN &&
+        (p->features & FEATURE_RESUME)) {
+        if (t->basis_fd != -1) {
+            close(t->basis_fd);
+            t->basis_fd = -1;
+        }
+        t->req.type = RESUMEFILE;
+        resume_part(p, t);
+        return 0;
+    }
+
+    // The temporary file is made in the same directory, so it can be renamed
+    // over the old copy.
+    if (!t->failed) {
+        t->tmp_path = malloc(strlen(t->req.path) + sizeof(".rcopy.XXXXXX"));
+        if (!t->tmp_path) {
+            perror("malloc");
+            exit(1);
+        }
+        sprintf(t->tmp_path, "%s.rcopy.XXXXXX", t->req.path);
+        if ((t->fd = mkstemp(t->tmp_path)) == -1) {
+            perror("mkstemp");
+            fprintf(stderr, "Error - creating file for %s\n", t->req.path);
+            free(t->tmp_path);
+            t->tmp_path = NULL;
+            t->failed = 1;
+        }
+    }
+
+    // Nothing more comes for a delta that can't be made.
+    if (t->failed) {
+        respond(p, ERROR, t->req.id, NULL, 0);
+        free_transfer(p, t);
+    } else {
+        queue_job(new_job(p, JOB_SIGNATURES, t));
+    }
+    return 0;
+}
+
+
+/* Copy len bytes at offset in of in_fd to offset out of out_fd, within the
+ * kernel if it can, or through a buffer if not.
+ * Return 0 on success, or -1 on error or if in_fd ends first.
+ */
+static int copy_range(int in_fd, loff_t in, int out_fd, loff_t out,
+                      long long len) {
+    static __thread char buf[ZBUF_SIZE];
+    int in_kernel = 1;
+
+    while (len > 0) {
+        ssize_t n;
+        if (in_kernel) {
+            n = copy_file_range(in_fd, &in, out_fd, &out, len, 0);
+            if (n == -1 && (errno == ENOSYS || errno == EXDEV ||
+                            errno == EINVAL || errno == EOPNOTSUPP)) {
+                in_kernel = 0;
+                continue;
+            }
+        } else {
+            n = pread(in_fd, buf, len < sizeof(buf) ? len : sizeof(buf), in);
+            for (ssize_t done = 0, written; n > 0 && done < n;
+                 done += written) {
+                if ((written = pwrite(out_fd, buf + done, n - done,
+                                      out + done)) == -1) {
+                    n = -1;
+                    break;
+                }
+            }
+            if (n > 0) {
+                in += n;
+                out += n;
+            }
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == -1) {
+                perror(in_kernel ? "copy_file_range" : "pread/pwrite");
+            }
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+
+/* Copy the blocks the COPY frame f names from the old copy of its file into
+ * the delta being built for the client p.
+ * Return 0 on success, or 3 if the client must be dropped.
+ */
+static int copy_blocks(struct client *p, const struct frame *f) {
+    struct transfer *t = find_transfer(p, f->id);
+    unsigned long long index, count;
+    int n, m;
+
+    if (!t || t->basis_fd == -1 || t->busy ||
+        (n = get_varint(f->payload, f->len, &index)) <= 0 ||
+        (m = get_varint(f->payload + n, f->len - n, &count)) <= 0 ||
+        n + m != f->len || index > t->blocks || count > t->blocks - index ||
+        count * t->block_size > t->remaining) {
+        fprintf(stderr, "Error - Unexpected blocks for %u from client %d\n",
+                f->id, p->fd);
+        return 3;
+    }
+
+    // Data waiting to be written comes before the blocks.
+    if (iov_owner == t) {
+        write_data(t);
+    }
+    if (!t->failed && copy_range(t->basis_fd, index * t->block_size, t->fd,
+                                 t->req.size - t->remaining,
+                                 count * t->block_size) == -1) {
+        fprintf(stderr, "Error - copying blocks for file %s\n", t->req.path);
+        t->failed = 1;
+    }
+
+    t->remaining -= count * t->block_size;
+    if (t->remaining == 0) {
+        end_transfer(p, t);
+    }
+    return 0;
+}
+
+
+/* Handle the frame f from the client p, which is in the state AWAITING_TYPE.
+ * Return 0 on success, or 3 if the client must be dropped.
+ */
+static int handleframe(struct client *p, const struct frame *f) {
+    if (f->type == MANIFEST) {
+        return answer_manifest(p, f);
+
+    } else if (f->type == COPY) {
+        return copy_blocks(p, f);
+
+    } else if (f->type == RESUMEAT) {
+        return resume_at(p, f);
+
+    } else if (f->type == REGFILE || f->type == REGDIR ||
+               f->type == TRANSFILE || f->type == DELTAFILE ||
+               f->type == RESUMEFILE) {
+        struct request req = {0};
+        if (get_entry(f->payload, f->len, f->type, &req) != f->len) {
+            fprintf(stderr, "Error - Request from client %d\n", p->fd);
+            free(req.path);
+            return 3;
+        }
+        req.id = f->id;
+
+        // The data of a TRANSFILE request follows in DATA frames.
+        if (req.type == TRANSFILE) {
+            return start_transfer(p, &req);
+        } else if (req.type == DELTAFILE) {
+            return start_delta(p, &req);
+        } else if (req.type == RESUMEFILE) {
+            return start_resume(p, &req);
+
+        } else if (!safe_path(req.path)) {
+            fprintf(stderr, "Error - Path outside destination: %s\n",
+                    req.path);
+            respond(p, ERROR, f->id, NULL, 0);
+
+        // A file is hashed on a worker, which takes the request over.
+        } else if (req.type == REGFILE) {
+            struct file_job *j = new_job(p, JOB_CHECK, NULL);
+            j->req = req;
+            queue_job(j);
+            return 0;
+
+        // Answer at once if it's a directory.
+        } else {
+            int check = checkfile(req);
+            respond(p, check == 0 ? OK : check == 1 ? SENDFILE : ERROR,
+                    f->id, NULL, 0);
+        }
+        free(req.path);
+        return 0;
+
+    } else {
+        fprintf(stderr, "Error - Request of type %d from client %d\n",
+                f->type, p->fd);
+        return 3;
+    }
+}
+
+
+/* Receive what the client p has sent, handle every complete frame in it, and
+ * send as much of the responses as the socket takes now. The payload of a
+ * DATA frame is taken as it arrives, without waiting for the rest of the
+ * frame. DATA frames for different transfers may come in any order.
+ * Return 0 for success, or 3 if client has closed or must be dropped.
+ */
+int handleclient(struct client *p) {
+    // Make room for a full read after what is left of a partial frame.
+    wbuf_reserve(&p->in, READ_SIZE);
+    int numread = read(p->fd, p->in.data + p->in.len, p->in.cap - p->in.len);
+
+    // Client has closed the socket, it should be removed.
+    if (numread == 0) {
+        return 3;
+    } else if (numread < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        perror("read");
+        fprintf(stderr, "Error - read: Read request from client %d\n", p->fd);
+        return 3;
+    }
+    p->in.len += numread;
+
+    struct frame f;
+    size_t pos = 0;
+    long n = 0;
+    int result = 0;
+    while (result == 0 && pos < p->in.len) {
+        char *buf = p->in.data + pos;
+        size_t avail = p->in.len - pos;
+
+        // In the middle of a DATA frame, the bytes belong to its file.
+        if (p->frame_left > 0) {
+            size_t take = p->frame_left < avail ? p->frame_left : avail;
+            p->frame_left -= take;
+            pos += take;
+            if (p->cur->zs) {
+                result = add_zdata(p, p->cur, buf, take);
+            } else {
+                add_data(p, p->cur, buf, take);
+            }
+
+        } else if (p->state == AWAITING_HELLO) {
+            if ((n = get_frame(buf, avail, &f)) <= 0) {
+                break;
+            }
+            pos += n;
+            result = hello(p, &f);
+
+        } else {
+            if ((n = get_header(buf, avail, &f)) <= 0) {
+                break;
+            }
+            if (f.type == DATA || f.type == ZDATA) {
+                p->cur = find_transfer(p, f.id);
+                if (!p->cur || p->cur->resuming || p->cur->busy ||
+                    (f.type == DATA ? p->cur->zs != NULL ||
+                                      f.len > p->cur->remaining :
+                                      start_zdata(p, p->cur) == -1)) {
+                    fprintf(stderr, "Error - Unexpected data for %u from "
+                            "client %d\n", f.id, p->fd);
+                    result = 3;
+                    break;
+                }
+                pos += n;
+                p->frame_left = f.len;
+                continue;
+            }
+
+            if ((n = get_frame(buf, avail, &f)) <= 0) {
+                break;
+            }
+            pos += n;
+            result = handleframe(p, &f);
+        }
+    }
+    if (n == -1) {
+        fprintf(stderr, "Error - Malformed frame from client %d\n", p->fd);
+        result = 3;
+    }
+
+    // The data points into the buffer, so write it before moving what is left.
+    if (iovcnt > 0) {
+        write_data(iov_owner);
+    }
+    memmove(p->in.data, p->in.data + pos, p->in.len - pos);
+    p->in.len -= pos;
+
+    if (result == 0) {
+        result = flushclient(p);
+    }
+    return result;
+}
+
+
+/* Send what the socket of the client p takes now of its waiting responses,
+ * and keep the rest for when it has room.
+ * Return 0 for success, or 3 if the client must be dropped.
+ */
+int flushclient(struct client *p) {
+    size_t done = 0;
+
+    while (done < p->out.len) {
+        // A client that went away must not kill the server with SIGPIPE.
+        ssize_t sent = send(p->fd, p->out.data + done, p->out.len - done,
+                            MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            perror("send");
+            fprintf(stderr, "Error - send: Responses to client %d\n", p->fd);
+            return 3;
+        }
+        done += sent;
+    }
+    memmove(p->out.data, p->out.data + done, p->out.len - done);
+    p->out.len -= done;
+    return 0;
+}
+
+
+/* Setup the socket listening on port, with room for backlog connections
+ * waiting to be accepted. If reuseport is set, other sockets may listen on the
+ * same port, and the kernel spreads new connections across them.
+ * Return the file-descriptor, which is an endpoint for communication. Exit if
+ * there is an error.
+ */
+int setup_server(unsigned short port, int backlog, int reuseport) {
+	int on = 1;
+  	struct sockaddr_in self;
+  	int listenfd;
+  	
+    // Non-blocking, so that every waiting connection can be accepted in turn
+    // until there are none left.
+    if ((listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
+    	perror("socket");
+    	exit(1);
+  	}
+
+  	// Make sure to reuse the port immediately after the server terminates.
+  	if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
+    	             &on, sizeof(on)) == -1) {
+    	perror("setsockopt -- REUSEADDR");
+  	}
+
+    if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                                &on, sizeof(on)) == -1) {
+        perror("setsockopt -- REUSEPORT");
+        close(listenfd);
+        exit(1);
+    }
+
+  	memset(&self, '\0', sizeof(self));
+  	self.sin_family = AF_INET;
+  	self.sin_addr.s_addr = INADDR_ANY;
+  	self.sin_port = htons(port);
+
+  	if (bind(listenfd, (struct sockaddr *)&self, sizeof(self)) < 0) {
+    	perror("bind");
+		close(listenfd);
+    	exit(1);
+  	}
+
+  	if (listen(listenfd, backlog) < 0) {
+    	perror("listen");
+		close(listenfd);
+    	exit(1);
+  	}
+  
+  	return listenfd;
+}
+
+
+/* Raise the limit on open files as far as allowed, since every client holds
+ * one.
+ */
+static void raise_fd_limit(void) {
+    struct rlimit lim;
+
+    if (getrlimit(RLIMIT_NOFILE, &lim) == -1) {
+        perror("getrlimit");
+        return;
+    }
+    if (lim.rlim_cur < lim.rlim_max) {
+        lim.rlim_cur = lim.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &lim) == -1) {
+            perror("setrlimit");
+        }
+    }
+}
+
+
+/* Accept every connection waiting on the socket of r, and watch each new
+ * client with its epoll instance. Out of fds, connections are accepted and
+ * closed at once, as the listener would otherwise keep waking the reactor.
+ */
+static void acceptclients(struct reactor *r) {
+ 	struct sockaddr_in peer;
+ 	socklen_t socklen;
+ 	int clientfd;
+
+    while (1) {
+        socklen = sizeof(peer);
+        // Pass in valid pointers for the second and third arguments to accept 
+        // here to store and use client information. Clients are non-blocking,
+        // so one that is slow to read can't stall the others.
+        if ((clientfd = accept4(r->sockfd, (struct sockaddr *)&peer, &socklen,
+                                SOCK_NONBLOCK)) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+                errno != ECONNABORTED) {
+                perror("accept");
+            }
+
+            // Out of fds. The listener is level-triggered, so a connection
+            // left in the backlog would wake the reactor again straight
+            // away: free the spare fd to take it, and turn it away.
+            if ((errno == EMFILE || errno == ENFILE) && r->spare_fd != -1) {
+                close(r->spare_fd);
+                clientfd = accept(r->sockfd, NULL, NULL);
+                if (clientfd != -1) {
+                    fprintf(stderr, "Error - Out of fds, connection closed\n");
+                    close(clientfd);
+                }
+                r->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                if (clientfd != -1) {
+                    continue;
+                }
+            }
+            return;
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = clientfd;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, clientfd, &ev) == -1) {
+            perror("epoll_ctl");
+            close(clientfd);
+            continue;
+        }
+        // Report successful connection to stdout.
+        printf("New connection on port %d\n", ntohs(peer.sin_port));
+        addclient(r, clientfd);
+    }
+}
+
+
+/* Handle the requests of the clients of the reactor arg, forever.
+ */
+static void *run_reactor(void *arg) {
+    struct reactor *r = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+ 	while (1) {
+		int nready = epoll_wait(r->epfd, events, MAX_EVENTS, -1);
+		// Error check epoll_wait.
+		if (nready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+			perror("epoll_wait");
 			exit(1);
 		}
+
+		for (int i = 0; i < nready; i++) {
+            int fd = events[i].data.fd;
+
+			// Activity on the original socket means new connections.
+            if (fd == r->sockfd) {
+                acceptclients(r);
+                continue;
+            }
+
+            // Jobs for its clients have come back from the workers.
+            if (fd == r->home.efd) {
+                pool_finish(&r->home);
+                continue;
+            }
+
+            struct client *p = fd < r->clients_size ? r->clients[fd] : NULL;
+            if (p == NULL) {
+                continue;
+            }
+						
+            // Send what is waiting once there is room, then read and manage
+            // data sent from the client, which answers it. Remove the client
+            // if it is done. Closing the fd also takes it out of epfd.
+            int result = 0;
+            if (events[i].events & EPOLLOUT) {
+                result = flushclient(p);
+            }
+            if (result == 0 && (events[i].events & ~EPOLLOUT) &&
+                ((p->events & EPOLLIN) ||
+                 (events[i].events & (EPOLLERR | EPOLLHUP)))) {
+                result = handleclient(p);
+            }
+            if (result == 0) {
+                result = watchclient(r, p);
+            }
+            if (result == 3) {
+                removeclient(r, fd);
+                close(fd);
+            }
+		}			    	
+  	}
+    return NULL;
+}
+
+
+/* Listen on port for and handle all requests from clients, with nreactors
+ * event loops each on its own thread. Up to backlog connections may wait to be
+ * accepted by each.
+ */
+void rcopy_server(unsigned short port, int backlog, int nreactors) {
+    if (nreactors < 1) {
+        nreactors = 1;
+    }
+    struct reactor *reactors = calloc(nreactors, sizeof(struct reactor));
+    if (!reactors) {
+        perror("calloc");
+        exit(1);
+    }
+
+    raise_fd_limit();
+
+    // A write to a client that has gone away fails with EPIPE instead.
+    signal(SIGPIPE, SIG_IGN);
+
+    // Files are read on workers, one per CPU, shared by every reactor.
+    pool_start(sysconf(_SC_NPROCESSORS_ONLN));
+
+    // Each reactor listens on a socket of its own, so the kernel balances
+    // connections between them instead of the threads contending to accept.
+    for (int i = 0; i < nreactors; i++) {
+        struct reactor *r = &reactors[i];
+
+        r->sockfd = setup_server(port, backlog, nreactors > 1);
+        r->epfd = epoll_create1(0);
+        if (r->epfd == -1) {
+            perror("epoll_create1");
+            exit(1);
+        }
+        r->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (r->spare_fd == -1) {
+            perror("open");
+            exit(1);
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = r->sockfd;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->sockfd, &ev) == -1) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+
+        pool_home_init(&r->home);
+        ev.data.fd = r->home.efd;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->home.efd, &ev) == -1) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+    }
+  	printf("Listening on %d with %d thread%s\n", port, nreactors,
+           nreactors == 1 ? "" : "s");
+
+    // This thread runs the first reactor.
+    for (int i = 1; i < nreactors; i++) {
+        int err = pthread_create(&reactors[i].thread, NULL, run_reactor,
+                                 &reactors[i]);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(1);
+        }
+    }
+    run_reactor(&reactors[0]);
+}
+
+
+//Code below this comment handles the client.
+
+
+/* Generate the information of file/directory rooted at parents concatenated
+ * with path, and return the corresponding struct request.
+ */
+struct request request_generator(const char *parent, char *path) {
+    struct request req;
+    struct stat st;
+    
+    // Get the fullpath of the file/directory.
+    // fullpath = parent + path
+    char fullpath[PATH_MAX];
+    snprintf(fullpath, PATH_MAX, "%s/%s", parent, path);
+    
+    // Check if fullpath if valid.
+    if (lstat(fullpath, &st) == -1) {
+        perror("lstat");
+        exit(EXIT_FAILURE);
+    }
+    
+    // Case 0: If fullpath is a link, we will set request's type as 0. Then it
+    // will not be copied.
+    if (S_ISLNK(st.st_mode)){
+        req.type = 0;
+        return req;
+    }
+    
+    // Pass in the file/directory's path, size and mode. Anything that is not
+    // a file or directory keeps type 0 too.
+    req.type = 0;
+    req.path = path;
+    req.size = st.st_size;
+    req.mode = st.st_mode;
+    
+    // Case 1: If fullpath is a regular file.
+    // We need to get the hash value of the file.
+    if(S_ISREG(st.st_mode)) {
+        req.type = 1;
         
-        typebuf = htons(req.size);
-        if (write(soc, &typebuf, sizeof(typebuf))== -1) {
-			perror("write");
-			exit(1);
-		}
-	
-		// Wait for and get response from the server.
-		int response_type;
-		if (read(soc, &response_type, sizeof(int)) < 0) {
-			perror("read");
-			exit(1);
-		}
-		response_type = ntohs(response_type);
+        FILE *fp = fopen(fullpath, "r");
+        if (fp == NULL) {
+            perror("fopen");
+            fprintf(stderr, "Error - fopen: opening file %s\n", fullpath);
+            exit(1);
+            // This could cause problems exiting stopping the recursion, but
+            // we did not have time to implement it as a return error in order
+            // to continue on with the recursion and close the socket properly.
+            
+        }
+        
+        hash(req.hash, fp);
+        fclose(fp);
+        
+    // Case 2: If fullpath is a directory.
+    } else if (S_ISDIR(st.st_mode)) {
+        req.type = 2;
+    }
+    
+    return req;
+}
+
+
+/* Return the basename of file rooted at the path fname.
+ */
+char *get_basename(const char *fname) {
+    char *basec, *bname;
+    basec = strdup(fname);
+    bname = basename(basec);
+    
+    return bname;
+}
+
+
+// A connection to the server, with the frames waiting to be sent on it and
+// what has been received but not yet read.
+struct conn {
+    int soc;
+    struct wbuf out;
+    struct wbuf in;
+    size_t start;           // Where the unread bytes in in begin.
+    int features;           // Optional features the server agreed to.
+};
+
+// Frames are collected in out until this many bytes are waiting.
+#define FLUSH_SIZE (64 * 1024)
+
+// Smallest DATA payload sent while more of the file is left.
+#define CHUNK_MIN (64 * 1024)
+
+// Bytes of a file deflated at a time into a ZDATA frame, at this level.
+#define ZCHUNK_SIZE (256 * 1024)
+#define COMPRESS_LEVEL Z_BEST_SPEED
+
+// Bytes of a file compressed to tell whether the rest is worth it.
+#define PROBE_SIZE (64 * 1024)
+
+// Bytes of a file looked through for blocks the server has before the other
+// transfers get a turn, and most literal bytes sent in one DATA frame.
+#define DELTA_STEP (1 << 20)
+#define LITERAL_MAX (256 * 1024)
+
+
+/* Take in what the server has sent on c, waiting for some first if wait is
+ * set, and keep it for read_frame. Exit if the server has closed the
+ * connection.
+ */
+static void take_input(struct conn *c, int wait) {
+    struct pollfd pfd = {c->soc, POLLIN, 0};
+
+    if (wait && poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+        perror("poll");
+        exit(1);
+    }
+    wbuf_reserve(&c->in, FLUSH_SIZE);
+    ssize_t numread = read(c->soc, c->in.data + c->in.len,
+                           c->in.cap - c->in.len);
+    if (numread > 0) {
+        c->in.len += numread;
+    } else if (numread == 0 || (errno != EINTR && errno != EAGAIN)) {
+        if (numread == -1) {
+            perror("read");
+        }
+        fprintf(stderr, "Error - Read response from server\n");
+        exit(1);
+    }
+}
+
+
+/* Wait until c can be written to. Meanwhile take in whatever the server
+ * sends, so that it never gets stuck writing answers to a client that is
+ * stuck writing to it.
+ */
+static void wait_writable(struct conn *c) {
+    struct pollfd pfd = {c->soc, POLLIN | POLLOUT, 0};
+
+    if (poll(&pfd, 1, -1) == -1) {
+        if (errno != EINTR) {
+            perror("poll");
+            exit(1);
+        }
+    } else if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+        take_input(c, 0);
+    }
+}
+
+
+/* Write all len bytes at buf to c. Return 0 on success, or -1 on error.
+ */
+static int write_all(struct conn *c, const void *buf, size_t len) {
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = write(c->soc, (const char *)buf + done, len - done);
+        if (n == -1) {
+            if (errno == EAGAIN) {
+                wait_writable(c);
+            } else if (errno != EINTR) {
+                return -1;
+            }
+            continue;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+
+/* Send every frame waiting on c. Exit if they can't be sent, since the server
+ * would be out of sync with the client anyway.
+ */
+static void flush(struct conn *c) {
+    if (write_all(c, c->out.data, c->out.len) == -1) {
+        perror("write");
+        fprintf(stderr, "Error - Write requests to socket\n");
+        exit(1);
+    }
+    c->out.len = 0;
+}
+
+
+/* Queue a frame of type for request id, with the len bytes at payload, on c.
+ */
+static void send_frame(struct conn *c, int type, unsigned id,
+                       const void *payload, size_t len) {
+    wbuf_frame(&c->out, type, id, payload, len);
+    if (c->out.len >= FLUSH_SIZE) {
+        flush(c);
+    }
+}
+
+
+/* Send what is waiting on c, then wait for the next frame from the server and
+ * parse it into *f. f->payload stays valid until the next call. Exit if the
+ * server closes the connection or sends something malformed.
+ */
+static void read_frame(struct conn *c, struct frame *f) {
+    long n;
+
+    if (c->out.len > 0) {
+        flush(c);
+    }
+    while ((n = get_frame(c->in.data + c->start, c->in.len - c->start,
+                          f)) == 0) {
+        // Move what is left of the frame to the front, and read the rest.
+        memmove(c->in.data, c->in.data + c->start, c->in.len - c->start);
+        c->in.len -= c->start;
+        c->start = 0;
+        take_input(c, 1);
+    }
+    if (n == -1) {
+        fprintf(stderr, "Error - Malformed response from server\n");
+        exit(1);
+    }
+    c->start += n;
+}
+
+
+/* Connect c to the server at host on port, and agree on the version of the
+ * protocol to use. Exit if there is none.
+ */
+static void connect_server(struct conn *c, char *host, unsigned short port) {
+    struct wbuf hello = {0};
+    struct frame f;
+    unsigned long long version, features;
+
+    *c = (struct conn){0};
+    c->soc = setup_client(host, port);
+
+    // Non-blocking, so that answers can be taken in while a write waits.
+    if (fcntl(c->soc, F_SETFL, O_NONBLOCK) == -1) {
+        perror("fcntl");
+        exit(1);
+    }
+
+    wbuf_put(&hello, RCOPY_MAGIC, strlen(RCOPY_MAGIC));
+    wbuf_varint(&hello, RCOPY_VERSION);
+    wbuf_varint(&hello, (rcopy_opts.compress ? FEATURE_ZLIB : 0) |
+                        (rcopy_opts.delta ? FEATURE_DELTA : 0) |
+                        FEATURE_RESUME);
+    send_frame(c, HELLO, 0, hello.data, hello.len);
+    wbuf_free(&hello);
+
+    read_frame(c, &f);
+    const char *pos = f.payload + strlen(RCOPY_MAGIC);
+    size_t len = f.len - strlen(RCOPY_MAGIC);
+    int n;
+    if (f.type != HELLO || f.len < strlen(RCOPY_MAGIC) ||
+        memcmp(f.payload, RCOPY_MAGIC, strlen(RCOPY_MAGIC)) != 0 ||
+        (n = get_varint(pos, len, &version)) <= 0 ||
+        version != RCOPY_VERSION ||
+        get_varint(pos + n, len - n, &features) <= 0) {
+        fprintf(stderr, "Error - Server does not speak rcopy version %d\n",
+                RCOPY_VERSION);
+        exit(1);
+    }
+    c->features = features;
+}
+
+
+/* Queue the request req on c, as a frame of its type holding its entry.
+ */
+static void send_request(struct conn *c, const struct request *req) {
+    struct wbuf entry = {0};
+
+    put_entry(&entry, req);
+    send_frame(c, req->type, req->id, entry.data, entry.len);
+    wbuf_free(&entry);
+}
+
+
+// The connection the tree is described on.
+static struct conn server;
+
+
+/* Return how many bytes of file data to send in the next DATA frame on soc:
+ * about what its send buffer holds, which the kernel grows as the
+ * connection speeds up, and at least CHUNK_MIN.
+ */
+static size_t data_chunk(int soc) {
+    int sndbuf;
+    socklen_t len = sizeof(sndbuf);
+
+    if (getsockopt(soc, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) == -1 ||
+        sndbuf < CHUNK_MIN) {
+        return CHUNK_MIN;
+    }
+    return sndbuf < MAX_FRAME ? sndbuf : MAX_FRAME;
+}
+
+
+// A file or directory the server has been asked about. req.path and fullpath
+// are owned by the entry.
+struct entry {
+    struct request req;
+    char *fullpath;
+};
+
+// A request that has been sent to the server and not answered yet: a single
+// entry, or a manifest of many.
+struct pending {
+    int used;
+    int manifest;
+    int count;
+    struct entry *entries;
+    struct wbuf payload;    // The entries of a manifest being filled.
+};
+
+// The requests in flight, indexed by id. The ids not in use are kept as a
+// stack in free_ids[inflight] to free_ids[window - 1].
+static struct pending *pending;
+static int *free_ids;
+static int inflight;
+static int window;
+
+// Entries per manifest in batch mode, or 0 to send single requests.
+static int batch_size;
+
+// The manifest being filled in batch mode, or NULL.
+static struct pending *batch;
+
+// Requests the server reported an error for.
+static int request_errors;
+
+// Working out the delta of a file from the signatures of the server's copy.
+// buf holds the file from offset on. The bytes from lit to pos match no
+// block and are still to be sent, after copy_count blocks from copy_index.
+struct matcher {
+    struct sigtable st;
+    char *sigs;         // The SIGNATURES payload st points into.
+    char *buf;
+    size_t cap;
+    size_t len;
+    size_t lit;
+    size_t pos;
+    off_t offset;
+    unsigned weak;      // Of the block at pos, if have_weak is set.
+    int have_weak;
+    long copy_index;
+    long copy_count;
+};
+
+// A file being sent to the server, from its TRANSFILE request until the
+// answer. Transfer i has the request id window + i, which no pending request
+// uses.
+struct upload {
+    int used;
+    int fd;             // The file, or -1 once all of it has been sent.
+    off_t sent;
+    int shortened;      // Set if the file got shorter while it was sent.
+    z_stream *zs;       // Deflating the file into ZDATA frames, or NULL to
+                        // send it as it is.
+    int awaiting;       // Set while the signatures for a delta, or where to
+                        // resume, have not come.
+    struct matcher *d;  // Working out the delta, or NULL.
+    struct entry e;
+};
+
+// The transfers, how many are in use, and how many of those still have data
+// to send.
+static struct upload *transfers;
+static int max_transfers;
+static int active;
+static int sending;
+
+// Files the server asked for, waiting for a free transfer in the order they
+// were asked for: queued[queue_head] to queued[nqueued - 1].
+static struct entry *queued;
+static int queue_head;
+static int nqueued;
+static int queued_size;
+
+
+/* Tell the user the server could not update the entry e.
+ */
+static void entry_error(const struct entry *e) {
+    fprintf(stderr, "Error - %s\n", e->fullpath);
+    request_errors++;
+}
+
+
+/* Add the file of the entry e to the files waiting to be sent. The queue
+ * takes over the strings of e.
+ */
+static void queue_file(struct entry *e) {
+    if (nqueued == queued_size) {
+        // Reuse the room of the files already taken before growing.
+        memmove(queued, queued + queue_head,
+                (nqueued - queue_head) * sizeof(struct entry));
+        nqueued -= queue_head;
+        queue_head = 0;
+        if (nqueued == queued_size) {
+            queued_size = queued_size ? queued_size * 2 : max_transfers;
+            queued = realloc(queued, queued_size * sizeof(struct entry));
+            if (!queued) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+    }
+    queued[nqueued++] = *e;
+    e->req.path = NULL;
+    e->fullpath = NULL;
+}
 
-		// Child process should be made to send TRANSFILE request.
-		if (response_type == SENDFILE) {
-			int pid = fork();
-			
-            if (pid < 0) {
-				perror("fork");
-				close(soc);
-				exit(1);
-			}
-            
-			// If it's a child process send data through a new socket.
-			if (pid == 0) {
-				soc = setup_client(host, PORT);
-				req.type = TRANSFILE;
-
-				FILE *fp = fopen(fullpath, "r");
-				if (fp == NULL) {
-					perror("fopen");
-					fprintf(stderr, "Error - fopen %s\n", fullpath);
-					exit(1);
-				}
-                
-				// Send request to server for file overwrite.
-				int typebuf = htons(req.type);
-        		if (write(soc, &typebuf, sizeof(typebuf)) == -1) {
-					perror("write");
-					fprintf(stderr, "Error - Write request for %s to socket\n",
-                            fullpath);
-					exit(1);
-				}
-                
-       			if (write(soc, &req.path, MAXPATH) == -1) {
-					perror("write");
-					fprintf(stderr, "Erroe - Write request for %s to socket\n",
-                            fullpath);
-					exit(1);
 
-				}
-                
-        		if (write(soc, &req.mode, sizeof(req.mode)) == -1) {
-					perror("write");
-					fprintf(stderr, "Failed to write request for %s to socket\n", fullpath);
-					exit(1);
+/* Free the strings of the entry e.
+ */
+static void free_entry(struct entry *e) {
+    free(e->req.path);
+    free(e->fullpath);
+}
 
-				}
-                
-        		if (write(soc, &req.hash, BLOCKSIZE) == -1) {
-					perror("write");
-					fprintf(stderr, "Error - write request for %s to socket\n",
-                            fullpath);
-					exit(1);
 
-				}
-                
-        		typebuf = htons(req.size);
-        		if (write(soc, &typebuf, sizeof(typebuf)) == -1) {
-					perror("write");
-					fprintf(stderr, "Error - Write request for %s to socket\n",
-                            fullpath);
-					exit(1);
+/* Return 1 if the file of size bytes open on fd looks worth compressing, or
+ * 0 if not. A sample from its middle is compressed, and has to shrink by at
+ * least a tenth; media and archives hardly shrink at all.
+ */
+static int worth_compressing(int fd, long long size) {
+    static char sample[PROBE_SIZE];
+    static char packed[PROBE_SIZE + PROBE_SIZE / 100 + 64];
+    off_t offset = size > PROBE_SIZE ? (size - PROBE_SIZE) / 2 : 0;
+    uLongf packed_len = sizeof(packed);
+    ssize_t n;
 
-				}
-				
-				// Send file's data.
-				char databuf[MAXDATA];
-                int num_read = fread(&databuf, sizeof(char), MAXDATA, fp);
-                if (write(soc, &databuf, num_read)== -1) {
-                    perror("write");
-                    fprintf(stderr, "Error - Write request for %s to socket\n",
-                            fullpath);
-                    exit(1);
-                }
-                
-				while (num_read == 256) {
-                    num_read = fread(&databuf, sizeof(char), MAXDATA, fp);
-                    if (num_read <0) {
-                        perror("fread");
-                        fprintf(stderr, "Error - Read file %s\n", fullpath);
-                        exit(1);
-                    }
-					if (write(soc, &databuf, num_read) == -1) {
-						perror("write");
-						fprintf(stderr, "Error - Write request for %s to socket\n",
-                                fullpath);
-						exit(1);
-					}
-				}
-                
-				if (read(soc, &response_type, sizeof(int)) < 0) {
-					perror("read");
-					exit(1);
-				}
-                
-				response_type = ntohs(response_type);
-				if (response_type == ERROR) {					
-					fprintf(stderr, "Error - %s\n", fullpath);
-					close(soc);
-					exit(1);
-				} else {
-					close(soc);
-					exit(0);
-				}
-			}
-            
-    	} else if (response_type == ERROR) {
-			fprintf(stderr, "Error - %s\n", fullpath);
-			return 1;
-		}
+    while ((n = pread(fd, sample, sizeof(sample), offset)) == -1 &&
+           errno == EINTR) {
+    }
+    if (n <= 0 || compress2((Bytef *)packed, &packed_len, (Bytef *)sample, n,
+                            COMPRESS_LEVEL) != Z_OK) {
+        return 0;
+    }
+    return packed_len * 10 <= n * 9;
+}
+
+
+/* Start sending the data of the transfer t, from t->sent on. A file with
+ * nothing left to send is done already.
+ */
+static void start_sending(struct upload *t) {
+    if (t->sent == t->e.req.size) {
+        close(t->fd);
+        t->fd = -1;
+        return;
+    }
+    sending++;
+    if ((server.features & FEATURE_ZLIB) &&
+        worth_compressing(t->fd, t->e.req.size)) {
+        t->zs = calloc(1, sizeof(z_stream));
+        if (!t->zs) {
+            perror("calloc");
+            exit(1);
+        }
+        if (deflateInit(t->zs, COMPRESS_LEVEL) != Z_OK) {
+            fprintf(stderr, "Error - deflateInit\n");
+            exit(1);
+        }
+    }
+}
+
+
+/* Give each free transfer the next file waiting to be sent, and ask the
+ * server to take it. A file that can't be opened is reported and skipped.
+ */
+static void start_transfers(void) {
+    for (int i = 0; i < max_transfers && queue_head < nqueued; i++) {
+        struct upload *t = &transfers[i];
+
+        while (!t->used && queue_head < nqueued) {
+            t->e = queued[queue_head++];
+            if ((t->fd = open(t->e.fullpath, O_RDONLY)) == -1) {
+                perror("open");
+                entry_error(&t->e);
+                free_entry(&t->e);
+                continue;
+            }
+            t->used = 1;
+            t->sent = 0;
+            t->shortened = 0;
+            t->zs = NULL;
+            t->awaiting = 0;
+            t->d = NULL;
+            active++;
+            t->e.req.id = window + i;
+
+            // A large file may be sent as a delta, once the server has said
+            // what it has of it. If it has nothing, it may answer as for
+            // RESUMEFILE instead.
+            if ((server.features & FEATURE_DELTA) &&
+                t->e.req.size >= DELTA_MIN) {
+                t->e.req.type = DELTAFILE;
+                t->awaiting = 1;
+                send_request(&server, &t->e.req);
+                continue;
+            }
+
+            // Otherwise it may pick up where an earlier transfer of it was
+            // cut off, once the server has said how far that got.
+            if ((server.features & FEATURE_RESUME) &&
+                t->e.req.size >= RESUME_MIN) {
+                t->e.req.type = RESUMEFILE;
+                t->awaiting = 1;
+                send_request(&server, &t->e.req);
+                continue;
+            }
+
+            // Ask the server to overwrite the file, then send exactly the size
+            // it was told of.
+            t->e.req.type = TRANSFILE;
+            send_request(&server, &t->e.req);
+            start_sending(t);
+        }
+    }
+    if (queue_head == nqueued) {
+        queue_head = nqueued = 0;
+    }
+}
+
+
+/* Send the next DATA frame of the transfer t. The payload goes from the page
+ * cache to the socket with sendfile, right behind its header.
+ */
+static void send_chunk(struct upload *t) {
+    static const char zeros[CHUNK_MIN];
+    size_t chunk = data_chunk(server.soc);
+
+    if (chunk > t->e.req.size - t->sent) {
+        chunk = t->e.req.size - t->sent;
+    }
+    wbuf_header(&server.out, DATA, t->e.req.id, chunk);
+    flush(&server);
+
+    for (off_t end = t->sent + chunk; t->sent < end; ) {
+        ssize_t n = sendfile(server.soc, t->fd, &t->sent, end - t->sent);
+        if (n == -1 && errno == EAGAIN) {
+            wait_writable(&server);
+            continue;
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            perror("sendfile");
+            fprintf(stderr, "Error - Send file %s\n", t->e.fullpath);
+            exit(1);
+        }
+
+        // The file got shorter since it was described. The server still
+        // expects the size it was told of, so the rest is made up with zeros
+        // and the transfer fails.
+        if (n == 0) {
+            size_t len = end - t->sent < CHUNK_MIN ? end - t->sent : CHUNK_MIN;
+            if (write_all(&server, zeros, len) == -1) {
+                perror("write");
+                fprintf(stderr, "Error - Send file %s\n", t->e.fullpath);
+                exit(1);
+            }
+            t->sent += len;
+            t->shortened = 1;
+        }
+    }
+
+    if (t->sent == t->e.req.size) {
+        close(t->fd);
+        t->fd = -1;
+        sending--;
+    }
+}
+
+
+/* Send the next ZCHUNK_SIZE bytes of the file of the transfer t, deflated,
+ * as a ZDATA frame, if they make any output yet. The stream is finished with
+ * the last of the file.
+ */
+static void send_zchunk(struct upload *t) {
+    static char in[ZCHUNK_SIZE];
+    static struct wbuf out;
+    size_t want = t->e.req.size - t->sent < ZCHUNK_SIZE ?
+                  t->e.req.size - t->sent : ZCHUNK_SIZE;
+    ssize_t n;
+
+    while ((n = pread(t->fd, in, want, t->sent)) == -1 && errno == EINTR) {
+    }
+
+    // The file got shorter since it was described, or can't be read. The rest
+    // is made up with zeros, as with DATA frames, and the transfer fails.
+    if (n <= 0) {
+        if (n == -1) {
+            perror("pread");
+        }
+        memset(in, 0, want);
+        n = want;
+        t->shortened = 1;
+    }
+    t->sent += n;
+
+    int flush = t->sent == t->e.req.size ? Z_FINISH : Z_NO_FLUSH;
+    t->zs->next_in = (Bytef *)in;
+    t->zs->avail_in = n;
+    out.len = 0;
+    do {
+        wbuf_reserve(&out, ZCHUNK_SIZE);
+        t->zs->next_out = (Bytef *)out.data + out.len;
+        t->zs->avail_out = out.cap - out.len;
+        deflate(t->zs, flush);
+        out.len = out.cap - t->zs->avail_out;
+    } while (t->zs->avail_out == 0);
+
+    if (out.len > 0) {
+        send_frame(&server, ZDATA, t->e.req.id, out.data, out.len);
+    }
+    if (flush == Z_FINISH) {
+        deflateEnd(t->zs);
+        free(t->zs);
+        t->zs = NULL;
+        close(t->fd);
+        t->fd = -1;
+        sending--;
+    }
+}
+
+
+/* Start working out the delta of the file of the transfer t from the
+ * SIGNATURES frame f. If the server has no blocks of it, it is sent whole.
+ */
+static void start_matching(struct upload *t, const struct frame *f) {
+    struct matcher *d = calloc(1, sizeof(struct matcher));
+
+    if (!d || !(d->sigs = malloc(f->len ? f->len : 1))) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(d->sigs, f->payload, f->len);
+    if (sigtable_load(&d->st, d->sigs, f->len) == -1) {
+        fprintf(stderr, "Error - Malformed signatures from server\n");
+        exit(1);
+    }
+    t->awaiting = 0;
+    sending++;
+
+    if (d->st.count == 0) {
+        sigtable_free(&d->st);
+        free(d->sigs);
+        free(d);
+        return;
+    }
+
+    // Room for the most literal bytes ever held back, a step and a block.
+    d->cap = LITERAL_MAX + DELTA_STEP + d->st.block_size;
+    if (!(d->buf = malloc(d->cap))) {
+        perror("malloc");
+        exit(1);
+    }
+    t->d = d;
+}
+
+
+/* Tell the server where the data of the transfer t starts, given the
+ * RESUME frame f: where its partial file left off, if that holds the same
+ * bytes as the start of the file, or else the start. Then start sending it.
+ */
+static void resume_from(struct upload *t, const struct frame *f) {
+    unsigned long long offset, h, own;
+    struct wbuf at = {0};
+    int n;
+
+    if ((n = get_varint(f->payload, f->len, &offset)) <= 0 ||
+        get_varint(f->payload + n, f->len - n, &h) != f->len - n) {
+        fprintf(stderr, "Error - Malformed resume from server\n");
+        exit(1);
+    }
+    t->awaiting = 0;
+    if (offset > 0 && offset <= t->e.req.size &&
+        hash_prefix(t->fd, offset, &own) == 0 && own == h) {
+        t->sent = offset;
+    }
+
+    wbuf_varint(&at, t->sent);
+    send_frame(&server, RESUMEAT, t->e.req.id, at.data, at.len);
+    wbuf_free(&at);
+    start_sending(t);
+}
+
+
+/* Send the blocks of the server's copy the delta of the transfer t has
+ * matched so far, as one COPY frame.
+ */
+static void send_copy(struct upload *t) {
+    struct matcher *d = t->d;
+    static struct wbuf payload;
+
+    if (d->copy_count > 0) {
+        payload.len = 0;
+        wbuf_varint(&payload, d->copy_index);
+        wbuf_varint(&payload, d->copy_count);
+        send_frame(&server, COPY, t->e.req.id, payload.data, payload.len);
+        d->copy_count = 0;
+    }
+}
+
+
+/* Send the bytes of the delta of the transfer t that matched no block, as a
+ * DATA frame, after the blocks matched before them.
+ */
+static void send_literal(struct upload *t) {
+    struct matcher *d = t->d;
+
+    if (d->pos > d->lit) {
+        send_copy(t);
+        send_frame(&server, DATA, t->e.req.id, d->buf + d->lit,
+                   d->pos - d->lit);
+        d->lit = d->pos;
+    }
+}
+
+
+/* Look through the next DELTA_STEP bytes of the file of the transfer t for
+ * blocks the server has, with a rolling checksum, and send the delta for
+ * them. Blocks in a row are sent as one COPY frame.
+ */
+static void send_delta(struct upload *t) {
+    struct matcher *d = t->d;
+    size_t block = d->st.block_size;
+    long long size = t->e.req.size;
+
+    // Drop what has been sent, and read as much more as fits. A file that
+    // got shorter or can't be read is made up with zeros, and fails.
+    memmove(d->buf, d->buf + d->lit, d->len - d->lit);
+    d->offset += d->lit;
+    d->pos -= d->lit;
+    d->len -= d->lit;
+    d->lit = 0;
+    while (d->len < d->cap && d->offset + d->len < size) {
+        size_t want = d->cap - d->len < size - (d->offset + d->len) ?
+                      d->cap - d->len : size - (d->offset + d->len);
+        ssize_t n = pread(t->fd, d->buf + d->len, want, d->offset + d->len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == -1) {
+                perror("pread");
+            }
+            memset(d->buf + d->len, 0, want);
+            n = want;
+            t->shortened = 1;
+        }
+        d->len += n;
+    }
+    int at_end = d->offset + d->len == size;
+
+    for (size_t stop = d->pos + DELTA_STEP; d->pos < stop; ) {
+        // The end of the file is too short to be a block.
+        if (d->pos + block > d->len) {
+            if (at_end) {
+                d->pos = d->len;
+            }
+            break;
+        }
+
+        if (!d->have_weak) {
+            d->weak = weak_sum(d->buf + d->pos, block);
+            d->have_weak = 1;
+        }
+        long next = d->copy_count > 0 ? d->copy_index + d->copy_count : -1;
+        long match = sigtable_find(&d->st, d->weak, d->buf + d->pos, next);
+        if (match >= 0) {
+            send_literal(t);
+            if (match == next) {
+                d->copy_count++;
+            } else {
+                send_copy(t);
+                d->copy_index = match;
+                d->copy_count = 1;
+            }
+            d->pos += block;
+            d->lit = d->pos;
+            d->have_weak = 0;
+        } else {
+            if (d->pos + block < d->len) {
+                d->weak = weak_roll(d->weak, d->buf[d->pos],
+                                    d->buf[d->pos + block], block);
+            } else {
+                d->have_weak = 0;
+            }
+            d->pos++;
+            if (d->pos - d->lit == LITERAL_MAX) {
+                send_literal(t);
+            }
+        }
+    }
+
+    if (at_end && d->pos == d->len) {
+        send_literal(t);
+        send_copy(t);
+        sigtable_free(&d->st);
+        free(d->sigs);
+        free(d->buf);
+        free(d);
+        t->d = NULL;
+        close(t->fd);
+        t->fd = -1;
+        sending--;
+    }
+}
+
+
+/* Act on the server's answer f to the manifest p.
+ */
+static void manifest_response(struct pending *p, const struct frame *f) {
+    unsigned long long count;
+    int n, size = BITMAP_SIZE(p->count);
+
+    // The count, then which entries the server needs, then which failed.
+    if (f->type != OK || (n = get_varint(f->payload, f->len, &count)) <= 0 ||
+        count != p->count || f->len - n != 2 * size) {
+        fprintf(stderr, "Error - Malformed manifest answer from server\n");
+        exit(1);
+    }
+    const unsigned char *need = (const unsigned char *)f->payload + n;
+
+    for (int i = 0; i < p->count; i++) {
+        if (need[size + i / 8] & (1 << (i % 8))) {
+            entry_error(&p->entries[i]);
+        } else if (need[i / 8] & (1 << (i % 8))) {
+            queue_file(&p->entries[i]);
+        }
+    }
+}
+
+
+/* Act on the server's answer f to the transfer t: the signatures to work out
+ * its delta from, where to resume it, or its result once all of it has been
+ * sent, which frees the transfer.
+ */
+static void transfer_response(struct upload *t, const struct frame *f) {
+    if (t->awaiting && f->type == SIGNATURES) {
+        start_matching(t, f);
+        return;
+    }
+    if (t->awaiting && f->type == RESUME) {
+        resume_from(t, f);
+        return;
+    }
+    if (f->type != OK || t->shortened) {
+        entry_error(&t->e);
+    }
+    // The server turned down a delta before anything was sent.
+    if (t->fd != -1) {
+        close(t->fd);
+        t->fd = -1;
+    }
+    free_entry(&t->e);
+    t->used = 0;
+    active--;
+}
+
+
+/* Wait for the server to answer one of the pending requests or transfers,
+ * and act on the answer. Answers may come in any order.
+ */
+static void handle_response(void) {
+    struct frame f;
+
+    read_frame(&server, &f);
+    if (f.id >= window && f.id - window < max_transfers &&
+        transfers[f.id - window].used && (transfers[f.id - window].awaiting ||
+                                          transfers[f.id - window].fd == -1)) {
+        transfer_response(&transfers[f.id - window], &f);
+        return;
+    }
+    if (f.id >= window || !pending[f.id].used) {
+        fprintf(stderr, "Error - Response to unknown request %u\n", f.id);
+        exit(1);
+    }
+    struct pending *p = &pending[f.id];
+
+    if (p->manifest) {
+        manifest_response(p, &f);
+
+    // The file is sent once a transfer is free.
+    } else if (f.type == SENDFILE) {
+        queue_file(&p->entries[0]);
+    } else if (f.type == ERROR) {
+        entry_error(&p->entries[0]);
+    }
+
+    for (int i = 0; i < p->count; i++) {
+        free_entry(&p->entries[i]);
+    }
+    free(p->entries);
+    wbuf_free(&p->payload);
+    p->used = 0;
+    inflight--;
+    free_ids[inflight] = f.id;
+}
+
+
+/* Return 1 if a frame from the server on c can be read without waiting, or
+ * 0 if not.
+ */
+static int frame_waiting(struct conn *c) {
+    struct frame f;
+    struct pollfd pfd = {c->soc, POLLIN, 0};
+
+    return get_frame(c->in.data + c->start, c->in.len - c->start, &f) != 0 ||
+           poll(&pfd, 1, 0) > 0;
+}
+
+
+/* Move the copy along: start the files waiting for a free transfer, send the
+ * next DATA frame of every file being sent, then handle the answers that
+ * have come. If nothing is being sent and wait is set, wait for an answer
+ * instead.
+ */
+static void make_progress(int wait) {
+    int on = 1, off = 0;
+
+    start_transfers();
+    if (sending == 0) {
+        if (wait) {
+            handle_response();
+        }
+        return;
+    }
+
+    // The socket is corked so the headers ride in the same segments as the
+    // data.
+    setsockopt(server.soc, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    for (int i = 0; i < max_transfers; i++) {
+        struct upload *t = &transfers[i];
+        if (!t->used || t->awaiting || t->fd == -1) {
+            continue;
+        } else if (t->d) {
+            send_delta(t);
+        } else if (t->zs) {
+            send_zchunk(t);
+        } else {
+            send_chunk(t);
+        }
+    }
+    setsockopt(server.soc, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+
+    while (frame_waiting(&server)) {
+        handle_response();
+    }
+}
+
+
+/* Wait for room in the window, then return a new pending request with space
+ * for count entries.
+ */
+static struct pending *new_pending(int count) {
+    make_progress(0);
+    while (inflight == window) {
+        make_progress(1);
+    }
+
+    struct pending *p = &pending[free_ids[inflight++]];
+    p->used = 1;
+    p->manifest = 0;
+    p->count = 0;
+    p->entries = malloc(count * sizeof(struct entry));
+    if (!p->entries) {
+        perror("malloc");
+        exit(1);
+    }
+    return p;
+}
+
+
+/* Queue the manifest p, made of the entries added to p->payload so far.
+ */
+static void send_manifest(struct pending *p) {
+    struct wbuf manifest = {0};
+
+    wbuf_varint(&manifest, p->count);
+    wbuf_put(&manifest, p->payload.data, p->payload.len);
+    send_frame(&server, MANIFEST, p - pending, manifest.data, manifest.len);
+    wbuf_free(&manifest);
+    wbuf_free(&p->payload);
+    p->manifest = 1;
+}
+
+
+/* Traverse file tree rooted at fullpath(parent + path), sending a request for
+ * each entry without waiting for the answers to earlier ones, as long as no
+ * more than the window are in flight. In batch mode, entries are gathered into
+ * manifests instead. Return 0 on success, or 1 on failure.
+ */
+int traverse_ftree(const char *parent, char *path) {
+    struct request req = request_generator(parent, path);
+   
+	char fullpath[PATH_MAX];
+    // Set fullpath to be the absolute path of the file or directory.
+    snprintf(fullpath, PATH_MAX, "%s/%s", parent, path);
+ 
+    // Case 1: If fullpath is not a link, then it might be a
+    // file/direcoty. Need transfer the info. to the server.
+    if (req.type != 0) {
+        struct pending *p;
+
+        if (batch_size > 0) {
+            if (!batch) {
+                batch = new_pending(batch_size);
+            }
+            p = batch;
+        } else {
+            p = new_pending(1);
+        }
+
+        req.id = p - pending;
+        if (batch_size == 0) {
+            send_request(&server, &req);
+        } else {
+            char type = req.type;
+            wbuf_put(&p->payload, &type, 1);
+            put_entry(&p->payload, &req);
+        }
+
+        struct entry *e = &p->entries[p->count++];
+        e->req = req;
+        e->req.path = strdup(path);
+        e->fullpath = strdup(fullpath);
+        if (!e->req.path || !e->fullpath) {
+            perror("strdup");
+            exit(1);
+        }
+
+        if (batch_size > 0 && (p->count == batch_size ||
+                               p->payload.len >= MANIFEST_BYTES)) {
+            send_manifest(p);
+            batch = NULL;
+        }
 	}
     
     // Case 2: If fullpath is a directory, then recurse to lower levels.
+    // The server handles requests in order, so it creates the directory
+    // before it sees anything inside.
     if (req.type == 2) {
         DIR *dir_ptr;
         struct dirent *content;
@@ -765,21 +2697,26 @@ int traverse_ftree(const char *parent, char *path, int soc, char *host) {
             // A file starting with ?.? should be skipped.
             if (content->d_name[0] != '.') {
                 // Get the new subpath of a innner file/directory.
-                char subpath[MAXPATH];
-                strncpy(subpath, path, MAXPATH);
-                strncat(subpath, "/", 2);
-                strncat(subpath, content->d_name, strlen(content->d_name));
+                char subpath[PATH_MAX];
+                if (snprintf(subpath, PATH_MAX, "%s/%s", path,
+                             content->d_name) >= PATH_MAX) {
+                    fprintf(stderr, "Error - Path too long: %s/%s\n", path,
+                            content->d_name);
+                    request_errors++;
+                    continue;
+                }
                 
-                traverse_ftree(parent, subpath, soc, host);
+                traverse_ftree(parent, subpath);
             }
         }
+        closedir(dir_ptr);
     }
     return 0;
 }
 
 
 /* Set up the socket for the client side. Return the file-descriptor, which is
- * an endpoint for communication. Teturn 1 if there is an error.
+ * an endpoint for communication. Exit if there is an error.
  */
 int setup_client(char *host, unsigned short port) {
 	int soc;
@@ -808,13 +2745,37 @@ int setup_client(char *host, unsigned short port) {
 
 
 /* Initiate a connection with rcopy_server, and send data of file or 
- * directory rooted at source.*/
+ * directory rooted at source. Return 0 on success, or 1 if the server
+ * reported errors.
+ */
 int rcopy_client(char *source, char *host, unsigned short port) {
+	connect_server(&server, host, port);
 
-  	char path[MAXPATH];
-	strncpy(path, source, MAXPATH);
-	
-	int soc = setup_client(host, port);	
+    // Every id starts out free. A manifest takes one id, however many entries
+    // it holds.
+    batch_size = rcopy_opts.batch > MANIFEST_MAX ? MANIFEST_MAX :
+                 rcopy_opts.batch;
+    window = rcopy_opts.window > 0 ? rcopy_opts.window :
+             batch_size > 0 ? DEFAULT_BATCH_WINDOW : DEFAULT_WINDOW;
+    pending = calloc(window, sizeof(struct pending));
+    free_ids = malloc(window * sizeof(int));
+    if (!pending || !free_ids) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < window; i++) {
+        free_ids[i] = i;
+    }
+
+    // Transfers take the ids after the window.
+    max_transfers = rcopy_opts.transfers <= 0 ? DEFAULT_TRANSFERS :
+                    rcopy_opts.transfers > MAX_TRANSFERS ? MAX_TRANSFERS :
+                    rcopy_opts.transfers;
+    transfers = calloc(max_transfers, sizeof(struct upload));
+    if (!transfers) {
+        perror("malloc");
+        exit(1);
+    }
 	
 	// Split source into it's basename and it's parent folders.
 	char* fname = get_basename(source);
@@ -822,10 +2783,24 @@ int rcopy_client(char *source, char *host, unsigned short port) {
 	strncpy(srccpy, source, strlen(source) + 1);
 	srccpy[strlen(srccpy) - strlen(fname) - 1] = '\0';
 
-	// Call recursive function to traverse the file tree. TODO: deal with responses
-	traverse_ftree(srccpy, fname, soc, host);
+	// Call recursive function to traverse the file tree, then wait for the
+    // answers still to come.
+	int result = traverse_ftree(srccpy, fname);
+    if (batch) {
+        send_manifest(batch);
+        batch = NULL;
+    }
+    while (inflight > 0 || active > 0 || nqueued > 0) {
+        make_progress(1);
+    }
   	
-  	close(soc);
+  	close(server.soc);
+    wbuf_free(&server.in);
+    wbuf_free(&server.out);
+    free(pending);
+    free(free_ids);
+    free(transfers);
+    free(queued);
     
-  	return 0;
+  	return result != 0 || request_errors != 0;
 }
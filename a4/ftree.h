@@ -3,61 +3,143 @@
 
 #include "hash.h"
 #include <sys/stat.h>
+#include <zlib.h>
+#include "wire.h"
 
 #define MAXPATH 128
-#define MAXDATA 256
 
 // Input states
-#define AWAITING_TYPE 0
-#define AWAITING_PATH 1
-#define AWAITING_SIZE 2
-#define AWAITING_PERM 3
-#define AWAITING_HASH 4
-#define AWAITING_DATA 5
+#define AWAITING_HELLO 0
+#define AWAITING_TYPE 1
 
 // Request types
 #define REGFILE 1
 #define REGDIR 2
 #define TRANSFILE 3
+#define MANIFEST 4
+#define DELTAFILE 8     // After the frame types in wire.h.
+#define RESUMEFILE 10
 
 #define OK 0
 #define SENDFILE 1
 #define ERROR 2
+#define SIGNATURES 3
+#define RESUME 4
 
 #ifndef PORT
     #define PORT 30100
 #endif
 
 
+// Requests rcopy_client sends before waiting for an answer, by default, and
+// the same for manifests in batch mode.
+#define DEFAULT_WINDOW 64
+#define DEFAULT_BATCH_WINDOW 4
+
+// Entries per manifest in batch mode, by default.
+#define DEFAULT_BATCH 4096
+
+// Files rcopy_client sends at once, interleaved on its connection, by
+// default, and the most the server takes from one client.
+#define DEFAULT_TRANSFERS 8
+#define MAX_TRANSFERS 256
+
+// Smallest file the server writes to a partial file, named for the file with
+// PART_SUFFIX after it, and renames into place once it is all there. The
+// partial file is kept if the client goes away first, for a later transfer
+// to resume.
+#define RESUME_MIN (1 << 20)
+#define PART_SUFFIX ".rcopy.part"
+
+
+/* Options that change how rcopy_client sends the tree. rcopy_client's main
+ * fills these in from the command line before starting the copy.
+ */
+struct rcopy_options {
+    int window;         // Most requests waiting for an answer at once, or 0
+                        // for the default.
+    int batch;          // Entries sent together in one manifest, or 0 to
+                        // send a request for each.
+    int transfers;      // Most files being sent at once, or 0 for the
+                        // default.
+    int compress;       // Set to send files that are worth it compressed,
+                        // if the server agrees.
+    int delta;          // Set to send only the changed blocks of files the
+                        // server has an older copy of, if it agrees.
+};
+
+extern struct rcopy_options rcopy_opts;
+
+
 struct request {
-    int type;           // Request type is REGFILE, REGDIR, TRANSFILE
-    char path[MAXPATH];
+    int type;           // Request type is REGFILE, REGDIR, TRANSFILE, MANIFEST
+    int id;             // Echoed in the response, to match it to the request
+    char *path;         // Relative to the root of the copy
     mode_t mode;
     char hash[BLOCKSIZE];
-    int size;
+    long long size;
+};
+
+
+// A file a client is sending, from its TRANSFILE request to the last of its
+// data.
+struct transfer {
+    struct request req;     // The TRANSFILE request, whose id names the
+                            // transfer.
+    long long remaining;    // Bytes of the file still to come.
+    long long start;        // Where the data begins: 0, or where a resumed
+                            // file left off.
+    int resuming;           // Set from RESUME until the client says where
+                            // it starts, in RESUMEAT.
+    int busy;               // Set while a worker reads its files, until the
+                            // request is answered.
+    int fd;                 // The file, open until it is all written.
+    int failed;             // Set if the file can't be written.
+    z_stream *zs;           // Inflating the file's ZDATA frames, or NULL if
+                            // none have come.
+    char *tmp_path;         // The temporary file a delta is built in, or
+                            // the partial file, which fd is open on, or NULL.
+    int basis_fd;           // The old copy a delta copies blocks from, or -1.
+    unsigned block_size;    // Of the blocks of the old copy.
+    long blocks;
+    struct transfer *next;  // Next transfer from the same client.
 };
 
 
+struct reactor;
+
 struct client {
 	int fd;
+	struct reactor *reactor;    // The event loop serving the client.
 	int state;
-	struct client *next;    
-    struct request req;
+	int features;           // Optional features agreed to in the HELLO.
+	struct wbuf in;         // Bytes received and not yet handled.
+	struct wbuf out;        // Responses waiting to be sent.
+	unsigned events;        // What epoll is watching the socket for.
+	struct transfer *transfers; // Files being sent, whose DATA frames may
+	                            // come interleaved.
+	int ntransfers;
+	struct transfer *cur;   // The transfer the current DATA frame is for.
+	long long frame_left;   // Bytes of the current DATA frame still to come.
+	int jobs;               // Jobs queued for it that have not come back.
+	int gone;               // Set once it is removed, while jobs are out.
+	struct client *next;    // Next free client, while not in use.
 };
 
 
 // Functions for rcopy_server.
-void rcopy_server(unsigned short port);
-int setup_server(void);
+void rcopy_server(unsigned short port, int backlog, int nreactors);
+int setup_server(unsigned short port, int backlog, int reuseport);
 int checkfile(struct request req);
 int setup_client(char *host, unsigned short port);
-int handleclient(struct client *p, struct client *top);
+int handleclient(struct client *p);
+int flushclient(struct client *p);
 
 // Functions for rcopy_client.
 int rcopy_client(char *source, char *host, unsigned short port);
 struct request request_generator(const char *parent, char *path);
 char *get_basename(const char *fname);
-int traverse_ftree(const char *parent, char *path, int soc, char *host);
+int traverse_ftree(const char *parent, char *path);
 int setup_client(char *host, unsigned short port);
 
 #endif // _FTREE_H_
@@ -1,11 +1,27 @@
 #ifndef _HASH_H_
 #define _HASH_H_
 
+#include <stdio.h>
+#include <stddef.h>
+
 #define BLOCKSIZE 8
 
+// Starting value for hash_buf.
+#define HASH_INIT 14695981039346656037ULL
+
 
 // Hash manipulation helper functions
 char *hash(char *hash_val, FILE *f);
 int check_hash(const char *hash1, const char *hash2);
 
+/* Continue the 64-bit FNV-1a hash h, eight bytes at a time, over the len
+ * bytes at buf, and return the result. Start from HASH_INIT.
+ */
+unsigned long long hash_buf(const char *buf, size_t len, unsigned long long h);
+
+/* Set *h to the hash_buf of the first len bytes of the file open on fd.
+ * Return 0 on success, or -1 if they can't all be read.
+ */
+int hash_prefix(int fd, long long len, unsigned long long *h);
+
 #endif // _HASH_H_
@@ -1,24 +1,52 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "hash.h"
 
 #define BLOCK_SIZE 8
 
+// Bytes of a file read at a time to hash it. A multiple of 8, so that the
+// hash comes out the same as over the whole of it at once.
+#define PREFIX_BUFSIZE (1 << 20)
+
+// Bytes read at a time by hash. A multiple of BLOCK_SIZE, for the same
+// reason.
+#define HASH_BUFSIZE (64 * 1024)
+
 
 /* Build the hash of size block_size, and save it at hash_val.
  */
 char *hash(char *hash_val, FILE *f) {
-    char ch;
+    char buf[HASH_BUFSIZE];
+    unsigned long long word, sum = 0;
+    size_t n;
     int hash_index = 0;
 
     for (int index = 0; index < BLOCK_SIZE; index++) {
         hash_val[index] = '\0';
     }
 
-    while(fread(&ch, 1, 1, f) != 0) {
-        hash_val[hash_index] ^= ch;
-        hash_index = (hash_index + 1) % BLOCK_SIZE;
+    // Byte i goes into hash_val[i % BLOCK_SIZE], so a whole word goes into
+    // all of it at once while the reads stay in step with the blocks.
+    while ((n = fread(buf, 1, sizeof(buf), f)) != 0) {
+        size_t i = 0;
+        if (hash_index == 0) {
+            for (; i + BLOCK_SIZE <= n; i += BLOCK_SIZE) {
+                memcpy(&word, buf + i, BLOCK_SIZE);
+                sum ^= word;
+            }
+        }
+        for (; i < n; i++) {
+            hash_val[hash_index] ^= buf[i];
+            hash_index = (hash_index + 1) % BLOCK_SIZE;
+        }
     }
 
+    memcpy(&word, hash_val, BLOCK_SIZE);
+    word ^= sum;
+    memcpy(hash_val, &word, BLOCK_SIZE);
     return hash_val;
 }
 
@@ -35,3 +63,54 @@ int check_hash(const char *hash1, const char *hash2) {
     }
     return 0;
 }
+
+
+unsigned long long hash_buf(const char *buf, size_t len, unsigned long long h) {
+    unsigned long long word;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&word, buf + i, 8);
+        h = (h ^ word) * 1099511628211ULL;
+    }
+    for (; i < len; i++) {
+        h = (h ^ (unsigned char)buf[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+
+int hash_prefix(int fd, long long len, unsigned long long *h) {
+    char *buf = malloc(PREFIX_BUFSIZE);
+
+    if (!buf) {
+        perror("malloc");
+        return -1;
+    }
+    *h = HASH_INIT;
+    for (long long offset = 0; offset < len; ) {
+        size_t want = len - offset < PREFIX_BUFSIZE ? len - offset :
+                                                      PREFIX_BUFSIZE;
+        size_t done = 0;
+
+        // Fill the buffer, so each piece but the last is a multiple of 8.
+        while (done < want) {
+            ssize_t n = pread(fd, buf + done, want - done, offset + done);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                if (n == -1) {
+                    perror("pread");
+                }
+                free(buf);
+                return -1;
+            }
+            done += n;
+        }
+        *h = hash_buf(buf, want, *h);
+        offset += want;
+    }
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,45 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "manifest.h"
+
+
+/* Record the result of checkfile for entry i in the bitmaps.
+ */
+static void mark(int i, int check, unsigned char *need,
+                 unsigned char *errors) {
+    if (check == 1) {
+        need[i / 8] |= 1 << (i % 8);
+    } else if (check == -1) {
+        errors[i / 8] |= 1 << (i % 8);
+    }
+}
+
+
+int check_dirs(struct request *reqs, int count, unsigned char *need,
+               unsigned char *errors) {
+    int files = 0;
+
+    // A directory's parent comes before it, and both before its files.
+    for (int i = 0; i < count; i++) {
+        if (reqs[i].type == REGDIR) {
+            mark(i, checkfile(reqs[i]), need, errors);
+        } else if (reqs[i].type == REGFILE) {
+            files++;
+        } else {
+            mark(i, -1, need, errors);
+        }
+    }
+    return files;
+}
+
+
+void check_files(struct request *reqs, int start, int end,
+                 unsigned char *need, unsigned char *errors) {
+    for (int i = start; i < end; i++) {
+        if (reqs[i].type == REGFILE) {
+            mark(i, checkfile(reqs[i]), need, errors);
+        }
+    }
+}
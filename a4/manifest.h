@@ -0,0 +1,44 @@
+#ifndef _MANIFEST_H_
+#define _MANIFEST_H_
+
+#include "ftree.h"
+
+// A manifest describes many files and directories in one MANIFEST frame:
+//   count     varint: entries that follow
+//   entries   for each, its type in one byte, then the entry as in a single
+//             request (see wire.h)
+// The server answers with an OK frame with the same id, holding the count, a
+// bitmap of the entries it needs the contents of, then a bitmap of the
+// entries it could not update. Bit i of a bitmap is bit i % 8 of byte i / 8.
+
+// Most entries in one manifest. The server drops clients that send more.
+#define MANIFEST_MAX 65536
+
+// A manifest is sent once its entries take this many bytes, however many
+// there are.
+#define MANIFEST_BYTES (MAX_FRAME / 2)
+
+// Bytes in a bitmap of count entries.
+#define BITMAP_SIZE(count) (((count) + 7) / 8)
+
+// Entries the server checks in one job. A multiple of 8, so no two jobs set
+// bits in the same byte of a bitmap.
+#define CHECK_CHUNK 64
+
+/* Run checkfile on each directory among the count entries in reqs, in order,
+ * setting bit i of need if entry i needs its contents sent and bit i of
+ * errors if it failed. Entries that are neither files nor directories fail.
+ * The bitmaps must start out zeroed. Once the directories are made, the
+ * files can be checked by check_files, on several threads at once.
+ * Return how many files there are.
+ */
+int check_dirs(struct request *reqs, int count, unsigned char *need,
+               unsigned char *errors);
+
+/* Run checkfile on each file among entries start to end of reqs, setting
+ * their bits as check_dirs does. start must be a multiple of 8.
+ */
+void check_files(struct request *reqs, int start, int end,
+                 unsigned char *need, unsigned char *errors);
+
+#endif // _MANIFEST_H_
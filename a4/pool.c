@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "pool.h"
+
+// Jobs waiting for a worker, oldest first.
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static struct job *queue_head;
+static struct job *queue_tail;
+
+
+/* Run jobs as they are queued, and hand each back to its home, forever.
+ */
+static void *worker(void *arg) {
+    (void)arg;
+
+    while (1) {
+        pthread_mutex_lock(&queue_lock);
+        while (!queue_head) {
+            pthread_cond_wait(&queue_ready, &queue_lock);
+        }
+        struct job *job = queue_head;
+        queue_head = job->next;
+        if (!queue_head) {
+            queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&queue_lock);
+
+        job->run(job);
+
+        // Only the first job back needs to wake the reactor.
+        struct pool_home *home = job->home;
+        pthread_mutex_lock(&home->lock);
+        int wake = home->done == NULL;
+        job->next = home->done;
+        home->done = job;
+        pthread_mutex_unlock(&home->lock);
+
+        uint64_t one = 1;
+        if (wake && write(home->efd, &one, sizeof(one)) == -1 &&
+            errno != EAGAIN) {
+            perror("write");
+        }
+    }
+    return NULL;
+}
+
+
+void pool_start(int nworkers) {
+    if (nworkers < 1) {
+        nworkers = 1;
+    }
+    for (int i = 0; i < nworkers; i++) {
+        pthread_t thread;
+        int err = pthread_create(&thread, NULL, worker, NULL);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+}
+
+
+void pool_home_init(struct pool_home *home) {
+    home->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (home->efd == -1) {
+        perror("eventfd");
+        exit(1);
+    }
+    pthread_mutex_init(&home->lock, NULL);
+    home->done = NULL;
+}
+
+
+void pool_submit(struct job *job) {
+    job->next = NULL;
+    pthread_mutex_lock(&queue_lock);
+    if (queue_tail) {
+        queue_tail->next = job;
+    } else {
+        queue_head = job;
+    }
+    queue_tail = job;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+
+void pool_finish(struct pool_home *home) {
+    uint64_t count;
+
+    // Clear the count before taking the jobs, so that one coming back after
+    // them wakes the reactor again.
+    if (read(home->efd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("read");
+    }
+    pthread_mutex_lock(&home->lock);
+    struct job *list = home->done;
+    home->done = NULL;
+    pthread_mutex_unlock(&home->lock);
+
+    // The list is newest first.
+    struct job *ordered = NULL;
+    while (list) {
+        struct job *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+    while (ordered) {
+        struct job *next = ordered->next;
+        ordered->done(ordered);
+        ordered = next;
+    }
+}
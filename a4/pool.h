@@ -0,0 +1,46 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <pthread.h>
+
+// The server reads files, to hash them or to make their signatures, on a pool
+// of worker threads shared by all the reactors, so that a large file holds up
+// no other client. A job is queued by a reactor, run on a worker, then handed
+// back to the reactor's home, whose eventfd wakes it to finish the job on its
+// own thread.
+
+struct job;
+
+// Where the jobs of one reactor come back to.
+struct pool_home {
+    int efd;                    // Readable while jobs have come back.
+    pthread_mutex_t lock;
+    struct job *done;           // Jobs back from the workers, newest first.
+};
+
+struct job {
+    void (*run)(struct job *job);   // Called on a worker.
+    void (*done)(struct job *job);  // Called on the thread of home, which
+                                    // frees the job.
+    struct pool_home *home;
+    struct job *next;
+};
+
+/* Start nworkers threads to run jobs on. Exit on error.
+ */
+void pool_start(int nworkers);
+
+/* Set up home, with nothing come back yet. Exit on error.
+ */
+void pool_home_init(struct pool_home *home);
+
+/* Queue job to be run on a worker, then handed back to job->home.
+ */
+void pool_submit(struct job *job);
+
+/* Call done for each job that has come back to home, in the order they were
+ * run. Called when home->efd is readable.
+ */
+void pool_finish(struct pool_home *home);
+
+#endif // _POOL_H_
@@ -1,5 +1,7 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "ftree.h"
 
 #ifndef PORT
@@ -7,17 +9,61 @@
 #endif
 
 
+/* Print how to run rcopy_client, and exit.
+ */
+static void usage(void) {
+    printf("Usage:\n\trcopy_client [-zd] [-w WINDOW] [-j TRANSFERS] [-m | -M ENTRIES] SRC HOST\n");
+    printf("\t SRC - The file or directory to copy to the server\n");
+    printf("\t HOST - The hostname of the server\n");
+    printf("\t -z - Compress the files that are worth it, if the server can\n");
+    printf("\t -d - Send only the changed blocks of files the server has an older\n"
+           "\t        copy of, if the server can\n");
+    printf("\t -w WINDOW - Most requests sent ahead of their answers (default: %d,\n"
+           "\t        or %d manifests with -m)\n", DEFAULT_WINDOW, DEFAULT_BATCH_WINDOW);
+    printf("\t -j TRANSFERS - Most files sent at once on the connection (default: %d)\n",
+           DEFAULT_TRANSFERS);
+    printf("\t -m - Describe the tree in manifests of %d entries, not one request each\n",
+           DEFAULT_BATCH);
+    printf("\t -M ENTRIES - Like -m, with ENTRIES entries per manifest\n");
+    exit(1);
+}
+
+
 int main(int argc, char **argv) {
     /* Note: In most cases, you'll want HOST to be localhost or 127.0.0.1, so 
      * you can test on your local machine.*/
-    if (argc != 3) {
-        printf("Usage:\n\trcopy_client SRC HOST\n");
-        printf("\t SRC - The file or directory to copy to the server\n");
-        printf("\t HOST - The hostname of the server");
-        return 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "zdw:j:mM:")) != -1) {
+        switch (opt) {
+            case 'z':
+                rcopy_opts.compress = 1;
+                break;
+            case 'd':
+                rcopy_opts.delta = 1;
+                break;
+            case 'w':
+                rcopy_opts.window = strtol(optarg, NULL, 10);
+                break;
+            case 'j':
+                rcopy_opts.transfers = strtol(optarg, NULL, 10);
+                break;
+            case 'm':
+                rcopy_opts.batch = DEFAULT_BATCH;
+                break;
+            case 'M':
+                rcopy_opts.batch = strtol(optarg, NULL, 10);
+                break;
+            default:
+                usage();
+        }
+    }
+
+    if (argc - optind != 2) {
+        usage();
     }
 
-    if (rcopy_client(argv[1], argv[2], PORT) != 0) {
+    if (rcopy_client(argv[optind], argv[optind + 1], PORT) != 0) {
         printf("Errors encountered during copy\n");
         return 1;
     } else {
@@ -5,6 +5,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <sys/socket.h>
 
 #include "ftree.h"
 
@@ -13,12 +14,37 @@
 #endif
 
 
+/* Print how to run rcopy_server, and exit.
+ */
+static void usage(const char *prog) {
+    printf("Usage:\n\t%s rcopy_server [-b BACKLOG] [-t THREADS] PATH_PREFIX\n", prog);
+    printf("\t PATH_PREFIX - The absolute path on the server that is used as the path prefix\n");
+    printf("\t        for the destination in which to copy files and directories.\n");
+    printf("\t -b BACKLOG - How many connections may wait to be accepted\n");
+    printf("\t        (default: the system limit)\n");
+    printf("\t -t THREADS - Number of threads serving clients (default: one per CPU)\n");
+    exit(1);
+}
+
+
 int main(int argc, char **argv) {
-    if(argc != 2) {
-        printf("Usage:\n\t%s rcopy_server PATH_PREFIX\n", argv[0]);
-        printf("\t PATH_PREFIX - The absolute path on the server that is used as the path prefix\n");
-        printf("\t        for the destination in which to copy files and directories.\n");
-        exit(1);
+    int opt, backlog = SOMAXCONN, threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((opt = getopt(argc, argv, "b:t:")) != -1) {
+        switch (opt) {
+            case 'b':
+                backlog = strtol(optarg, NULL, 10);
+                break;
+            case 't':
+                threads = strtol(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if(argc - optind != 1) {
+        usage(argv[0]);
     }
     /* NOTE:  The directory PATH_PREFIX/sandbox/dest will be the directory in
      * which the source files and directories will be copied.  It therefore 
@@ -29,7 +55,7 @@ int main(int argc, char **argv) {
     
     // Create the sandbox directory.
     char path[MAXPATH];
-    strncpy(path, argv[1], MAXPATH);
+    strncpy(path, argv[optind], MAXPATH);
     strncat(path, "/", MAXPATH - strlen(path) + 1);
     strncat(path, "sandbox", MAXPATH - strlen(path) + 1);
     
@@ -64,7 +90,7 @@ int main(int argc, char **argv) {
     /* IMPORTANT: All path operations in rcopy_server must be relative to
      * the current working directory.
      */
-    rcopy_server(PORT);
+    rcopy_server(PORT, backlog, threads);
 
     // Should never get here!
     fprintf(stderr, "Server reached exit point.");
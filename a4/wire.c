@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ftree.h"
+#include "wire.h"
+
+
+void wbuf_reserve(struct wbuf *b, size_t len) {
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + len) {
+            cap *= 2;
+        }
+        char *grown = realloc(b->data, cap);
+        if (!grown) {
+            perror("realloc");
+            exit(1);
+        }
+        b->data = grown;
+        b->cap = cap;
+    }
+}
+
+
+void wbuf_put(struct wbuf *b, const void *data, size_t len) {
+    wbuf_reserve(b, len);
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+
+/* Write v as a varint to buf, which has room for MAX_VARINT bytes.
+ * Return the bytes it took.
+ */
+static int put_varint(char *buf, unsigned long long v) {
+    int n = 0;
+
+    while (v >= 0x80) {
+        buf[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    buf[n++] = v;
+    return n;
+}
+
+
+void wbuf_varint(struct wbuf *b, unsigned long long v) {
+    char buf[MAX_VARINT];
+
+    wbuf_put(b, buf, put_varint(buf, v));
+}
+
+
+void wbuf_header(struct wbuf *b, int type, unsigned id, size_t len) {
+    char header[MAX_HEADER];
+    int n = 0;
+
+    header[n++] = type;
+    n += put_varint(header + n, len);
+    n += put_varint(header + n, id);
+    wbuf_put(b, header, n);
+}
+
+
+void wbuf_frame(struct wbuf *b, int type, unsigned id, const void *payload,
+                size_t len) {
+    wbuf_header(b, type, id, len);
+    wbuf_put(b, payload, len);
+}
+
+
+void wbuf_free(struct wbuf *b) {
+    free(b->data);
+    b->data = NULL;
+    b->len = b->cap = 0;
+}
+
+
+int get_varint(const char *buf, size_t len, unsigned long long *v) {
+    *v = 0;
+    for (int i = 0; i < MAX_VARINT; i++) {
+        if (i == len) {
+            return 0;
+        }
+        *v |= (unsigned long long)(buf[i] & 0x7f) << (7 * i);
+        if (!(buf[i] & 0x80)) {
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+
+long get_header(const char *buf, size_t len, struct frame *f) {
+    unsigned long long payload_len, id;
+    int n, pos = 1;
+
+    if (len < 1) {
+        return 0;
+    }
+    f->type = (unsigned char)buf[0];
+
+    if ((n = get_varint(buf + pos, len - pos, &payload_len)) <= 0) {
+        return n;
+    }
+    pos += n;
+    if ((n = get_varint(buf + pos, len - pos, &id)) <= 0) {
+        return n;
+    }
+    pos += n;
+    if (payload_len > MAX_FRAME || id > 0xffffffff) {
+        return -1;
+    }
+
+    f->id = id;
+    f->len = payload_len;
+    f->payload = buf + pos;
+    return pos;
+}
+
+
+long get_frame(const char *buf, size_t len, struct frame *f) {
+    long n = get_header(buf, len, f);
+
+    if (n <= 0 || len - n < f->len) {
+        return n <= 0 ? n : 0;
+    }
+    return n + f->len;
+}
+
+
+void put_entry(struct wbuf *b, const struct request *req) {
+    size_t path_len = strlen(req->path);
+
+    wbuf_varint(b, req->mode);
+    wbuf_varint(b, req->size);
+    if (req->type != REGDIR) {
+        wbuf_put(b, req->hash, BLOCKSIZE);
+    }
+    wbuf_varint(b, path_len);
+    wbuf_put(b, req->path, path_len);
+}
+
+
+int get_entry(const char *buf, size_t len, int type, struct request *req) {
+    unsigned long long mode, size, path_len;
+    int n, pos = 0;
+
+    if ((n = get_varint(buf, len, &mode)) <= 0) {
+        return -1;
+    }
+    pos += n;
+    if ((n = get_varint(buf + pos, len - pos, &size)) <= 0) {
+        return -1;
+    }
+    pos += n;
+    if (type != REGDIR) {
+        if (len - pos < BLOCKSIZE) {
+            return -1;
+        }
+        memcpy(req->hash, buf + pos, BLOCKSIZE);
+        pos += BLOCKSIZE;
+    } else {
+        memset(req->hash, 0, BLOCKSIZE);
+    }
+    if ((n = get_varint(buf + pos, len - pos, &path_len)) <= 0 ||
+        path_len > len - pos - n) {
+        return -1;
+    }
+    pos += n;
+
+    // A NUL inside the path would hide what follows it.
+    if (memchr(buf + pos, '\0', path_len) != NULL) {
+        return -1;
+    }
+    req->path = malloc(path_len + 1);
+    if (!req->path) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(req->path, buf + pos, path_len);
+    req->path[path_len] = '\0';
+
+    req->type = type;
+    req->mode = mode;
+    req->size = size;
+    return pos + path_len;
+}
+
+
+int safe_path(const char *path) {
+    if (path[0] == '\0' || path[0] == '/') {
+        return 0;
+    }
+    for (const char *p = path; p; p = strchr(p, '/')) {
+        if (*p == '/') {
+            p++;
+        }
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0')) {
+            return 0;
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,146 @@
+#ifndef _WIRE_H_
+#define _WIRE_H_
+
+#include <stddef.h>
+
+struct request;
+
+// Version 2 of the rcopy protocol sends everything in frames:
+//   type      one byte: a request, a response, DATA or HELLO
+//   length    varint: bytes of payload after the header
+//   id        varint: the request the frame belongs to
+//   payload
+// A varint holds 7 bits per byte, low bits first, with the top bit set on
+// every byte but the last.
+//
+// On connecting, the client sends a HELLO with RCOPY_MAGIC, the highest
+// version it speaks and the features it would like. The server answers with
+// a HELLO holding the version both will use and the features it agreed to,
+// or with ERROR and closes the connection if there is no such version.
+//
+// REGFILE, REGDIR and TRANSFILE requests carry one entry:
+//   mode      varint
+//   size      varint
+//   hash      BLOCKSIZE bytes, for files only
+//   path      varint length, then the bytes of the path, relative to the
+//             root of the copy
+// The answer is OK, SENDFILE or ERROR with the same id. After TRANSFILE
+// comes the contents of the file in DATA frames with the same id, and the
+// server answers once it has all size bytes. Several files may be sent at
+// once on the same connection, their DATA frames interleaved, and requests
+// may come between them.
+#define RCOPY_MAGIC "RCPY"
+#define RCOPY_VERSION 2
+
+// Longest varint, and longest frame header.
+#define MAX_VARINT 10
+#define MAX_HEADER (1 + 2 * MAX_VARINT)
+
+// Largest payload either side accepts.
+#define MAX_FRAME (16 << 20)
+
+// Frame types besides the requests and responses in ftree.h.
+#define DATA 5
+#define HELLO 6
+#define ZDATA 7
+#define COPY 9
+#define RESUMEAT 11
+
+// Optional features, agreed to in the HELLO exchange.
+//   FEATURE_ZLIB  The contents of a file may be sent in ZDATA frames instead
+//                 of DATA frames: one zlib stream, split across them at any
+//                 point, that inflates to the size bytes of the file. The
+//                 server answers once the stream ends. A file is sent all in
+//                 DATA or all in ZDATA, and an empty file in neither.
+//   FEATURE_DELTA A file the server has an older copy of may be sent as the
+//                 blocks that changed, with DELTAFILE (see delta.h).
+//   FEATURE_RESUME A file may be sent with RESUMEFILE, which carries an entry
+//                 as TRANSFILE does, to pick up where an earlier transfer of
+//                 it was cut off. The server answers with RESUME:
+//                   offset  varint: bytes of the file its partial file holds
+//                   hash    varint: hash_buf of those bytes
+//                 or with ERROR, and then nothing more is sent for the file.
+//                 The client answers with RESUMEAT, holding a varint offset:
+//                 the server's if its own file starts with the same bytes,
+//                 or 0. The data from there on follows as after TRANSFILE.
+#define FEATURE_ZLIB 1
+#define FEATURE_DELTA 2
+#define FEATURE_RESUME 4
+#define FEATURES (FEATURE_ZLIB | FEATURE_DELTA | FEATURE_RESUME)
+
+// Bytes that are added to, growing the buffer as needed.
+struct wbuf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+// A frame parsed out of the bytes received. payload points into them.
+struct frame {
+    int type;
+    unsigned id;
+    size_t len;
+    const char *payload;
+};
+
+/* Make sure b has room for len more bytes after what it holds.
+ */
+void wbuf_reserve(struct wbuf *b, size_t len);
+
+/* Add the len bytes at data to the end of b.
+ */
+void wbuf_put(struct wbuf *b, const void *data, size_t len);
+
+/* Add v to the end of b as a varint.
+ */
+void wbuf_varint(struct wbuf *b, unsigned long long v);
+
+/* Add the header of a frame of type for request id, with len bytes of
+ * payload, to the end of b. The caller sends the payload after it.
+ */
+void wbuf_header(struct wbuf *b, int type, unsigned id, size_t len);
+
+/* Add a frame of type for request id, with the len bytes at payload, to the
+ * end of b.
+ */
+void wbuf_frame(struct wbuf *b, int type, unsigned id, const void *payload,
+                size_t len);
+
+/* Free the bytes of b, and leave it empty.
+ */
+void wbuf_free(struct wbuf *b);
+
+/* Read a varint from the len bytes at buf into *v.
+ * Return the bytes it took, 0 if it runs past len, or -1 if it is too long.
+ */
+int get_varint(const char *buf, size_t len, unsigned long long *v);
+
+/* Parse the header of the frame at the start of the len bytes at buf into
+ * *f, whether or not its payload is all there.
+ * Return the bytes the header takes, 0 if not all of it is there yet, or -1
+ * if it is malformed or the payload is larger than MAX_FRAME.
+ */
+long get_header(const char *buf, size_t len, struct frame *f);
+
+/* Parse the frame at the start of the len bytes at buf into *f.
+ * Return the bytes the whole frame takes, 0 if not all of it is there yet,
+ * or -1 if it is malformed or larger than MAX_FRAME.
+ */
+long get_frame(const char *buf, size_t len, struct frame *f);
+
+/* Add the entry for req to the end of b.
+ */
+void put_entry(struct wbuf *b, const struct request *req);
+
+/* Read an entry of the given type from the len bytes at buf into req, with a
+ * newly allocated path that the caller must free.
+ * Return the bytes it took, or -1 if it is malformed.
+ */
+int get_entry(const char *buf, size_t len, int type, struct request *req);
+
+/* Return 1 if path names something inside the root of the copy: it is not
+ * empty or absolute and has no ".." components. Otherwise return 0.
+ */
+int safe_path(const char *path);
+
+#endif // _WIRE_H_